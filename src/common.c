@@ -1,49 +1,318 @@
 #include "common.h"
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+
+#ifdef _WIN32
+#include <sys/time.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <errno.h>
+#endif
 
 #include <Rinternals.h>
+#include <Rversion.h>
 
 static int need_init = 1;
 
+/* size of the read-ahead buffer of files (option tiff.read.ahead) and
+   whether files are mapped (option tiff.mmap) */
+#define READ_AHEAD (1 << 20)
+static tsize_t read_ahead = READ_AHEAD;
+static int map_files = 1;
+
 static char txtbuf[2048];
 
+static tiff_stats_t *timing; /* statistics of timed jobs, see TIFF_Timing() */
+
 static TIFF *last_tiff; /* this to avoid leaks */
+static void *last_job;  /* client data of last_tiff */
+
+/* worker threads must not call R, so the handlers only record the
+   first error there and the main thread reports it after joining */
+static __thread int in_worker;
+static __thread int worker_errors;
+static __thread char worker_msg[512];
+
+static void worker_error(const char *module, const char *msg) {
+    if (!worker_errors++)
+	snprintf(worker_msg, sizeof(worker_msg), "%s: %s", module, msg);
+}
+
+/* global handlers, with TIFF_JOB_ERRORS they only see messages that
+   don't belong to a TIFF opened by us */
+static int err_reenter = 0;
+
+static void open_failed(tiff_job_t *rj);
 
 static void TIFFWarningHandler_(const char* module, const char* fmt, va_list ap) {
+    /* warnings are dropped in workers and while the error handler closes
+       the TIFF (an R warning may turn into an error and skip the reset
+       of err_reenter) */
+    if (in_worker || err_reenter)
+	return;
     /* we can't pass it directly since R has no vprintf entry point */
     vsnprintf(txtbuf, sizeof(txtbuf), fmt, ap);
     Rf_warning("%s: %s", module, txtbuf);
 }
 
-static int err_reenter = 0;
-
 static void TIFFErrorHandler_(const char* module, const char* fmt, va_list ap) {
+    if (in_worker) {
+	char msg[512];
+	vsnprintf(msg, sizeof(msg), fmt, ap);
+	worker_error(module, msg);
+	return;
+    }
     if (err_reenter) return; /* prevent re-entrance which can happen as TIFF is happy to call another error from Close */
     err_reenter = 1;
-    /* FIXME: if TIFFClose below fails we may get stuck without errors!! */
     /* we can't pass it directly since R has no vprintf entry point */
     vsnprintf(txtbuf, sizeof(txtbuf), fmt, ap);
     /* we have to close the TIFF that caused it as it will not
-       come back -- recursive calls won't work under errors
-       but that is hopefully unlikely/impossible */
+       come back. Errors and warnings it reports while closing are
+       ignored, nothing in TIFFClose() calls R, so err_reenter is
+       always reset before the error is raised */
     if (last_tiff)
 	TIFFClose(last_tiff); /* this will also reset last_tiff */
+    else if (last_job) { /* the error comes from TIFF_Open() */
+	open_failed((tiff_job_t*) last_job);
+	last_job = 0;
+    }
     err_reenter = 0;
     Rf_error("%s: %s", module, txtbuf);
 }
 
-static void init_tiff(void) {
+#ifdef TIFF_JOB_ERRORS
+/* handlers of TIFFs opened by us, they only record the messages in the
+   job so they are safe in any thread. R errors are raised later (see
+   TIFF_Errors()) once the caller is back in control and can release
+   what it holds. */
+static int job_error(TIFF *tiff, void *user_data, const char *module, const char *fmt, va_list ap) {
+    tiff_job_t *rj = (tiff_job_t*) user_data;
+    char msg[512];
+    vsnprintf(msg, sizeof(msg), fmt, ap);
+    if (!module)
+	module = "TIFF";
+    if (in_worker)
+	worker_error(module, msg);
+    if (!rj->errors++)
+	snprintf(rj->err, sizeof(rj->err), "%s: %s", module, msg);
+    return 1;
+}
+
+static int job_warning(TIFF *tiff, void *user_data, const char *module, const char *fmt, va_list ap) {
+    tiff_job_t *rj = (tiff_job_t*) user_data;
+    char msg[512];
+    if (in_worker) /* warnings are dropped in workers */
+	return 1;
+    vsnprintf(msg, sizeof(msg), fmt, ap);
+    if (!rj->warnings++)
+	snprintf(rj->warn, sizeof(rj->warn), "%s: %s", module ? module : "TIFF", msg);
+    return 1;
+}
+#endif
+
+int TIFF_Errors(tiff_job_t *rj, char *msg, size_t len) {
+    int n = rj->errors, w = rj->warnings;
+    rj->errors = rj->warnings = 0;
+    if (n && msg)
+	snprintf(msg, len, "%s", rj->err);
+    if (w == 1)
+	Rf_warning("%s", rj->warn);
+    else if (w > 1)
+	Rf_warning("%s (and %d more warnings)", rj->warn, w - 1);
+    return n;
+}
+
+void TIFF_Init(void) {
+    SEXP opt = GetOption1(install("tiff.read.ahead")), map = GetOption1(install("tiff.mmap"));
     if (need_init) {
 	TIFFSetWarningHandler(TIFFWarningHandler_);
 	TIFFSetErrorHandler(TIFFErrorHandler_);
 	need_init = 0;
     }
+    /* the settings are only read here (in the main thread) */
+    if (opt == R_NilValue)
+	read_ahead = READ_AHEAD;
+    else {
+	double v = asReal(opt);
+	read_ahead = (ISNAN(v) || v < 0) ? 0 : ((v > 1073741824.0) ? 1073741824 : (tsize_t) v);
+    }
+    map_files = (map == R_NilValue || asLogical(map) == TRUE);
 }
 
-static tsize_t TIFFReadProc_(thandle_t usr, tdata_t buf, tsize_t length) {
-    tiff_job_t *rj = (tiff_job_t*) usr;
+double TIFF_Time(void) {
+#ifdef _WIN32
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return (double) tv.tv_sec + ((double) tv.tv_usec) / 1e6;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + ((double) ts.tv_nsec) / 1e9;
+#endif
+}
+
+void TIFF_Timing(tiff_stats_t *st) {
+    if (st)
+	memset(st, 0, sizeof(*st));
+    timing = st;
+}
+
+static void timing_end(void *data, Rboolean jump) {
+    timing = 0;
+}
+
+SEXP TIFF_Timed(tiff_stats_t *st, SEXP (*fun)(void *data), void *data) {
+    SEXP res;
+    TIFF_Timing(st);
+#if R_VERSION >= R_Version(3, 5, 0)
+    if (st) {
+	SEXP cont = PROTECT(R_MakeUnwindCont());
+	res = R_UnwindProtect(fun, data, timing_end, 0, cont);
+	UNPROTECT(1);
+	return res;
+    }
+#endif
+    res = fun(data);
+    timing_end(0, FALSE);
+    return res;
+}
+
+void TIFF_Timing_Job(tiff_job_t *rj) {
+    rj->stats = timing;
+}
+
+void TIFF_Stats_Add(tiff_stats_t *to, const tiff_stats_t *from) {
+    to->bytes += from->bytes;
+    to->mapped += from->mapped;
+    to->calls += from->calls;
+    to->sys_calls += from->sys_calls;
+    to->seeks += from->seeks;
+    to->chunks += from->chunks;
+    if (from->scratch > to->scratch)
+	to->scratch = from->scratch;
+    to->io += from->io;
+    to->codec += from->codec;
+    to->convert += from->convert;
+    to->alloc += from->alloc;
+}
+
+SEXP TIFF_Timing_Info(const tiff_stats_t *st, double total) {
+    const char *names[] = { "bytes", "mapped", "io.calls", "sys.calls", "seeks", "chunks", "scratch",
+			    "io", "codec", "convert", "alloc", "total" };
+    double val[] = { st->bytes, st->mapped, st->calls, st->sys_calls, st->seeks, st->chunks, st->scratch,
+		     st->io, st->codec, st->convert, st->alloc, total };
+    int i, n = (int) (sizeof(val) / sizeof(val[0]));
+    SEXP res = PROTECT(allocVector(REALSXP, n)), nam = allocVector(STRSXP, n);
+    setAttrib(res, R_NamesSymbol, nam);
+    for (i = 0; i < n; i++) {
+	REAL(res)[i] = val[i];
+	SET_STRING_ELT(nam, i, mkChar(names[i]));
+    }
+    UNPROTECT(1);
+    return res;
+}
+
+/* Files opened for reading are not read through the stdio position
+   but with pread() at the position kept in the job, so handles on the
+   same file can share the descriptor across threads and seeks are
+   free. Reads smaller than the read-ahead buffer fill it, so small
+   reads of directories and adjacent strips or tiles turn into few
+   large requests. On Windows the buffer is filled by fseeko()/fread(). */
+static tsize_t file_read(tiff_job_t *rj, void *buf, tsize_t n, toff_t off) {
+#ifndef _WIN32
+    int fd = fileno(rj->f);
+    tsize_t got = 0;
+    while (got < n) {
+	ssize_t r = pread(fd, (char*) buf + got, (size_t) (n - got), (off_t) (off + got));
+	if (rj->stats)
+	    rj->stats->sys_calls++;
+	if (r < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return got ? got : -1;
+	}
+	if (r == 0)
+	    break;
+	got += r;
+    }
+    return got;
+#else
+    if (fseeko(rj->f, (off_t) off, SEEK_SET))
+	return -1;
+    if (rj->stats)
+	rj->stats->sys_calls++;
+    return (tsize_t) fread(buf, 1, n, rj->f);
+#endif
+}
+
+static tsize_t file_read_ahead(tiff_job_t *rj, tdata_t buf, tsize_t length) {
+    tsize_t got = 0, n;
+    if (rj->pos >= rj->ra_off && rj->pos < rj->ra_off + rj->ra_len) {
+	n = (tsize_t) (rj->ra_off + rj->ra_len - rj->pos);
+	if (n > length)
+	    n = length;
+	memcpy(buf, rj->ra + (rj->pos - rj->ra_off), n);
+	rj->pos += n;
+	got = n;
+    }
+    if (got < length && rj->ra_size > 0 && !rj->ra && !(rj->ra = malloc(rj->ra_size)))
+	rj->ra_size = 0;
+    if (got < length) {
+	if (length - got >= rj->ra_size) /* large reads go directly to buf */
+	    n = file_read(rj, (char*) buf + got, length - got, rj->pos);
+	else {
+	    n = file_read(rj, rj->ra, rj->ra_size, rj->pos);
+	    rj->ra_off = rj->pos;
+	    rj->ra_len = (n > 0) ? n : 0;
+	    if (n > length - got)
+		n = length - got;
+	    if (n > 0)
+		memcpy((char*) buf + got, rj->ra, n);
+	}
+	if (n < 0)
+	    return got ? got : -1;
+	rj->pos += n;
+	got += n;
+    }
+    return got;
+}
+
+static toff_t file_size(tiff_job_t *rj) {
+    if (rj->size == (toff_t) -1) {
+#ifndef _WIN32
+	struct stat st;
+	if (!fstat(fileno(rj->f), &st))
+	    rj->size = (toff_t) st.st_size;
+#else
+	if (!fseeko(rj->f, 0, SEEK_END))
+	    rj->size = (toff_t) ftello(rj->f);
+#endif
+    }
+    return rj->size;
+}
+
+/* set up the fields of the job for TIFFClientOpen() with mode */
+static void init_job(tiff_job_t *rj, const char *mode) {
+    rj->rd = (rj->f && *mode == 'r');
+    rj->shared = 0;
+    rj->no_map = !map_files;
+    rj->pos = rj->ra_off = 0;
+    rj->size = (toff_t) -1;
+    rj->ra = 0;
+    rj->ra_len = 0;
+    rj->ra_size = read_ahead;
+    rj->errors = rj->warnings = 0;
+    if (!in_worker)
+	rj->stats = timing;
+}
+
+static tsize_t job_read(tiff_job_t *rj, tdata_t buf, tsize_t length) {
     tsize_t to_read = length;
+    if (rj->rd)
+	return file_read_ahead(rj, buf, length);
     if (rj->f)
 	return fread(buf, 1, to_read, rj->f);
 #if TIFF_DEBUG
@@ -58,6 +327,26 @@ static tsize_t TIFFReadProc_(thandle_t usr, tdata_t buf, tsize_t length) {
     return to_read;
 }
 
+/* account a read or write of n bytes which started at t0 */
+static void count_io(tiff_stats_t *st, double t0, tsize_t n) {
+    st->io += TIFF_Time() - t0;
+    st->calls++;
+    if (n > 0)
+	st->bytes += n;
+}
+
+static tsize_t TIFFReadProc_(thandle_t usr, tdata_t buf, tsize_t length) {
+    tiff_job_t *rj = (tiff_job_t*) usr;
+    double t0;
+    tsize_t n;
+    if (!rj->stats)
+	return job_read(rj, buf, length);
+    t0 = TIFF_Time();
+    n = job_read(rj, buf, length);
+    count_io(rj->stats, t0, n);
+    return n;
+}
+
 static int guarantee_write_buffer(tiff_job_t *rj, long where) {
     if (where > rj->alloc) { /* need to resize buffer? */
 	void *new_data;
@@ -73,10 +362,12 @@ static int guarantee_write_buffer(tiff_job_t *rj, long where) {
     return 1;
 }
 
-static tsize_t TIFFWriteProc_(thandle_t usr, tdata_t buf, tsize_t length) {
-    tiff_job_t *rj = (tiff_job_t*) usr;
-    if (rj->f)
+static tsize_t job_write(tiff_job_t *rj, tdata_t buf, tsize_t length) {
+    if (rj->f) {
+	if (rj->stats)
+	    rj->stats->sys_calls++;
 	return (tsize_t) fwrite(buf, 1, length, rj->f);
+    }
 #if TIFF_DEBUG
     Rprintf("write [@%d %d/%d] <- %d\n", rj->ptr, rj->len, rj->alloc, length);
 #endif
@@ -89,12 +380,42 @@ static tsize_t TIFFWriteProc_(thandle_t usr, tdata_t buf, tsize_t length) {
     return length;
 }
 
+static tsize_t TIFFWriteProc_(thandle_t usr, tdata_t buf, tsize_t length) {
+    tiff_job_t *rj = (tiff_job_t*) usr;
+    double t0;
+    tsize_t n;
+    if (!rj->stats)
+	return job_write(rj, buf, length);
+    t0 = TIFF_Time();
+    n = job_write(rj, buf, length);
+    count_io(rj->stats, t0, n);
+    return n;
+}
+
+/* seek problems are errors in workers, otherwise they are collected
+   with the warnings of the job (R must not be called from libtiff) */
+static void seek_warning(tiff_job_t *rj, const char *msg) {
+    if (in_worker)
+	worker_error("TIFFSeekProc", msg);
+    else if (!rj->warnings++)
+	snprintf(rj->warn, sizeof(rj->warn), "TIFFSeekProc: %s", msg);
+}
+
 static toff_t  TIFFSeekProc_(thandle_t usr, toff_t offset, int whence) {
     tiff_job_t *rj = (tiff_job_t*) usr;
+    if (rj->stats)
+	rj->stats->seeks++;
+    if (rj->rd) {
+	if (whence == SEEK_CUR)
+	    offset += rj->pos;
+	else if (whence == SEEK_END)
+	    offset += file_size(rj);
+	return rj->pos = offset;
+    }
     if (rj->f) {
 	int e = fseeko(rj->f, offset, whence);
 	if (e != 0) {
-	    Rf_warning("fseek failed on a file in TIFFSeekProc");
+	    seek_warning(rj, "fseek failed");
 	    return -1;
 	}
 	return ftello(rj->f);
@@ -107,7 +428,7 @@ static toff_t  TIFFSeekProc_(thandle_t usr, toff_t offset, int whence) {
     else if (whence == SEEK_END)
 	offset += rj->len;
     else if (whence != SEEK_SET) {
-	Rf_warning("invalid `whence' argument to TIFFSeekProc callback called by libtiff");
+	seek_warning(rj, "invalid whence");
 	return -1;
     }
     if (rj->alloc && rj->len < offset) {
@@ -119,7 +440,7 @@ static toff_t  TIFFSeekProc_(thandle_t usr, toff_t offset, int whence) {
 	rj->len = offset;
     }
     if (offset < 0 || offset > rj->len) {
-	Rf_warning("libtiff attempted to seek beyond the data end");
+	seek_warning(rj, "seek beyond the data end");
 	return -1;
     }
     return (toff_t) (rj->ptr = offset);
@@ -127,19 +448,27 @@ static toff_t  TIFFSeekProc_(thandle_t usr, toff_t offset, int whence) {
 
 static int     TIFFCloseProc_(thandle_t usr) {
     tiff_job_t *rj = (tiff_job_t*) usr;
-    if (rj->f)
-	fclose(rj->f);
-    else if (rj->alloc) {
+    if (rj->rd) {
+	free(rj->ra);
+	rj->ra = 0;
+    }
+    if (rj->f) {
+	if (!rj->shared)
+	    fclose(rj->f);
+    } else if (rj->alloc) {
 	free(rj->data);
 	rj->data = 0;
 	rj->alloc = 0;
     }
-    last_tiff = 0;
+    if (!in_worker && usr == last_job) /* TIFFClose() has already freed the TIFF */
+	last_tiff = last_job = 0;
     return 0;
 }
 
 static toff_t  TIFFSizeProc_(thandle_t usr) {
     tiff_job_t *rj = (tiff_job_t*) usr;
+    if (rj->rd)
+	return file_size(rj);
     if (rj->f) {
 	off_t cur = ftello(rj->f), end;
 	fseek(rj->f, 0, SEEK_END);
@@ -150,24 +479,177 @@ static toff_t  TIFFSizeProc_(thandle_t usr) {
     return (toff_t) rj->len;
 }
 
+/* read-only sources are mapped so libtiff can use the data in place:
+   raw vectors are exposed directly and files are mmap()ed */
 static int     TIFFMapFileProc_(thandle_t usr, tdata_t* map, toff_t* off) {
-    Rf_warning("libtiff attempted to use TIFFMapFileProc on non-file which is unsupported");
-    return -1;
+    tiff_job_t *rj = (tiff_job_t*) usr;
+    if (rj->f) {
+#ifndef _WIN32
+	toff_t size = TIFFSizeProc_(usr);
+	void *m;
+	if (rj->no_map || size == 0 || size != (toff_t) (size_t) size)
+	    return 0;
+	m = mmap(0, (size_t) size, PROT_READ, MAP_SHARED, fileno(rj->f), 0);
+	if (m == MAP_FAILED)
+	    return 0;
+	*map = m;
+	*off = size;
+	if (rj->stats)
+	    rj->stats->mapped += (double) size;
+	return 1;
+#else
+	return 0; /* libtiff falls back to reading */
+#endif
+    }
+    if (rj->alloc) /* in-memory output buffer can move */
+	return 0;
+    *map = (tdata_t) rj->data;
+    *off = (toff_t) rj->len;
+    if (rj->stats)
+	rj->stats->mapped += (double) rj->len;
+    return 1;
 }
 
 static void    TIFFUnmapFileProc_(thandle_t usr, tdata_t map, toff_t off) {
-    Rf_warning("libtiff attempted to use TIFFUnmapFileProc on non-file which is unsupported");
+#ifndef _WIN32
+    tiff_job_t *rj = (tiff_job_t*) usr;
+    if (rj->f)
+	munmap(map, (size_t) off);
+#endif
+}
+
+/* open rj with our procs (and handlers) */
+static TIFF *client_open(const char *mode, tiff_job_t *rj) {
+#ifdef TIFF_JOB_ERRORS
+    TIFFOpenOptions *opts = TIFFOpenOptionsAlloc();
+    TIFF *tiff;
+    if (!opts)
+	return 0;
+    TIFFOpenOptionsSetErrorHandlerExtR(opts, job_error, rj);
+    TIFFOpenOptionsSetWarningHandlerExtR(opts, job_warning, rj);
+    tiff = TIFFClientOpenExt("pkg:tiff", mode, (thandle_t) rj, TIFFReadProc_, TIFFWriteProc_, TIFFSeekProc_,
+			     TIFFCloseProc_, TIFFSizeProc_, TIFFMapFileProc_, TIFFUnmapFileProc_, opts);
+    TIFFOpenOptionsFree(opts);
+    return tiff;
+#else
+    return TIFFClientOpen("pkg:tiff", mode, (thandle_t) rj, TIFFReadProc_, TIFFWriteProc_, TIFFSeekProc_,
+			  TIFFCloseProc_, TIFFSizeProc_, TIFFMapFileProc_, TIFFUnmapFileProc_);
+#endif
+}
+
+/* libtiff doesn't call the close proc if opening fails, so files
+   opened for reading are closed here */
+static void open_failed(tiff_job_t *rj) {
+    if (rj->rd) {
+	free(rj->ra);
+	rj->ra = 0;
+	if (!rj->shared)
+	    fclose(rj->f);
+	rj->f = 0;
+    }
 }
 
 /* actual interface */
 TIFF *TIFF_Open(const char *mode, tiff_job_t *rj) {
-    if (need_init) init_tiff();
+    TIFF *tiff;
+    TIFF_Init();
 #if AGGRESSIVE_CLEANUP
     if (last_tiff)
 	TIFFClose(last_tiff);
 #endif
-    return (last_tiff = 
-	    TIFFClientOpen("pkg:tiff", mode, (thandle_t) rj, TIFFReadProc_, TIFFWriteProc_, TIFFSeekProc_,
-			   TIFFCloseProc_, TIFFSizeProc_, TIFFMapFileProc_, TIFFUnmapFileProc_)
-	    );
+    init_job(rj, mode);
+    last_job = rj;
+    if (!(tiff = last_tiff = client_open(mode, rj)))
+	open_failed(rj);
+    return tiff;
+}
+
+/* the TIFF is owned by an R object (handle), so it must not be closed
+   when an error occurs */
+void TIFF_Keep(TIFF *tiff) {
+    if (last_tiff == tiff)
+	last_tiff = last_job = 0;
+}
+
+static TIFF *worker_open(tiff_job_t *wj, const char *mode) {
+    TIFF *tiff;
+    int shared = wj->shared;
+    init_job(wj, mode);
+    wj->shared = shared;
+    if (!(tiff = client_open(mode, wj)))
+	open_failed(wj);
+    return tiff;
+}
+
+/* open another read-only handle on the same source as rj positioned at
+   the directory dir. Only to be used from worker threads between
+   TIFF_Worker_Begin() and TIFF_Worker_End() */
+TIFF *TIFF_Reopen(const tiff_job_t *rj, tiff_job_t *wj, toff_t dir) {
+    TIFF *tiff;
+    tiff_stats_t *stats = wj->stats;
+    *wj = *rj;
+    wj->stats = stats;
+    wj->ptr = 0;
+    wj->shared = 0;
+#ifndef _WIN32
+    /* positional reads don't touch the file position, so the file can be shared */
+    if (rj->rd)
+	wj->shared = 1;
+    else
+#endif
+    if (rj->f && !(wj->f = fopen(rj->fn, "rb"))) {
+	worker_error("TIFF_Reopen", "unable to open file");
+	return 0;
+    }
+    if (!(tiff = worker_open(wj, "rc")))
+	return 0;
+    if (!TIFFSetSubDirectory(tiff, dir)) {
+	TIFFClose(tiff);
+	return 0;
+    }
+    return tiff;
+}
+
+/* open the file fn for reading with the libtiff mode flags mode, same
+   restrictions as TIFF_Reopen() */
+TIFF *TIFF_Worker_Open(const char *fn, tiff_job_t *wj, const char *mode) {
+    memset(wj, 0, sizeof(*wj));
+    if (!(wj->f = fopen(fn, "rb"))) {
+	worker_error("TIFF_Worker_Open", "unable to open file");
+	return 0;
+    }
+    wj->fn = fn;
+    return worker_open(wj, mode);
+}
+
+/* create an in-memory TIFF for writing (e.g., to encode strips or
+   tiles for another TIFF), same restrictions as TIFF_Reopen() */
+TIFF *TIFF_Worker_Create(tiff_job_t *wj) {
+    TIFF *tiff;
+    memset(wj, 0, sizeof(*wj));
+    wj->alloc = 64 * 1024;
+    if (!(wj->data = malloc(wj->alloc))) {
+	worker_error("TIFF_Worker_Create", "unable to allocate memory for the output buffer");
+	return 0;
+    }
+    if (!(tiff = worker_open(wj, "wm"))) {
+	free(wj->data);
+	wj->data = 0;
+    }
+    return tiff;
+}
+
+void TIFF_Worker_Begin(void) {
+    in_worker = 1;
+    worker_errors = 0;
+    worker_msg[0] = 0;
+}
+
+/* returns the number of errors in this thread, msg receives the first one */
+int TIFF_Worker_End(char *msg, size_t len) {
+    int n = worker_errors;
+    if (n && msg)
+	snprintf(msg, len, "%s", worker_msg);
+    in_worker = 0;
+    return n;
 }
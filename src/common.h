@@ -4,13 +4,103 @@
 #include <stdio.h>
 #include <tiff.h>
 #include <tiffio.h>
+#include <tiffvers.h>
+#include <Rinternals.h>
+
+/* libtiff 4.5.0 and higher report errors to handlers of each TIFF
+   (the version macros were added in the same release) */
+#ifdef TIFFLIB_MAJOR_VERSION
+#define TIFF_JOB_ERRORS 1
+#endif
+
+/* statistics collected for timing=TRUE, times are in seconds. Jobs
+   opened while TIFF_Timing() is active count into it. */
+typedef struct tiff_stats {
+    double bytes;     /* bytes read or written by libtiff */
+    double mapped;    /* bytes of mapped input */
+    double calls;     /* read or write requests of libtiff */
+    double sys_calls; /* reads and writes of the file */
+    double seeks;
+    double chunks;    /* strips or tiles decoded or encoded */
+    double scratch;   /* peak size of strip or tile buffers */
+    double io, codec, convert, alloc; /* time spent in each phase */
+} tiff_stats_t;
 
 typedef struct tiff_job {
     FILE *f;
+    const char *fn; /* file name (if f is set) */
     long ptr, len, alloc;
     char *data;
+    /* files opened for reading use positional reads (see common.c),
+       the fields below are set up by TIFF_Open() */
+    int rd;         /* f is read positionally */
+    int shared;     /* f belongs to another job, don't close it */
+    int no_map;     /* don't map f */
+    toff_t pos, size; /* file position and size (-1 if not known yet) */
+    char *ra;       /* read-ahead buffer holding ra_len bytes from ra_off */
+    toff_t ra_off;
+    tsize_t ra_len, ra_size;
+    /* messages of libtiff for this job, see TIFF_Errors() */
+    int errors, warnings;
+    char err[512], warn[512];
+    tiff_stats_t *stats; /* set if the job is timed */
 } tiff_job_t;
 
+/* persistent handle created by openTIFF(). The job and the TIFF stay
+   open between reads, the directory index is built on first use.
+   Handles opened for writing receive the images of writeTIFF(). */
+typedef struct tiff_handle {
+    TIFF *tiff;
+    tiff_job_t rj;
+    toff_t first;  /* offset of the first image */
+    toff_t *dirs;  /* directory index (malloc()ed) */
+    int n_dirs;
+    int next;      /* number of images visited by nextTIFF() */
+    int writing;   /* open for writing */
+    int pages;     /* number of images written */
+    int failed;    /* writing an image failed, the file is incomplete */
+} tiff_handle_t;
+
+void  TIFF_Init(void); /* installs the handlers, done by TIFF_Open() */
 TIFF *TIFF_Open(const char *mode, tiff_job_t *rj);
+void  TIFF_Keep(TIFF *tiff);
+
+/* With TIFF_JOB_ERRORS libtiff errors and warnings of a TIFF are
+   collected in its job instead of raising R errors from within libtiff
+   (older libtiff raises them right away and closes the TIFF). Returns
+   the number of errors since the last call with the first one in msg
+   and issues collected warnings. Main thread only. */
+int   TIFF_Errors(tiff_job_t *rj, char *msg, size_t len);
+
+/* report an error or warning for tiff the same way as libtiff does */
+#ifdef TIFF_JOB_ERRORS
+#define TIFF_Error(tiff, module, ...) TIFFErrorExtR(tiff, module, __VA_ARGS__)
+#define TIFF_Warning(tiff, module, ...) TIFFWarningExtR(tiff, module, __VA_ARGS__)
+#else
+#define TIFF_Error(tiff, module, ...) TIFFError(module, __VA_ARGS__)
+#define TIFF_Warning(tiff, module, ...) TIFFWarning(module, __VA_ARGS__)
+#endif
+
+/* timing=TRUE: jobs opened from now on by the main thread (and a job
+   of a handle passed to TIFF_Timing_Job()) count into st which is
+   cleared, NULL stops. TIFF_Timed() calls fun(data) with timing into st
+   and stops it when fun returns or raises an error (R >= 3.5.0).
+   TIFF_Time() is a wall clock in seconds and TIFF_Timing_Info() the
+   result reported to R. */
+void   TIFF_Timing(tiff_stats_t *st);
+SEXP   TIFF_Timed(tiff_stats_t *st, SEXP (*fun)(void *data), void *data);
+void   TIFF_Timing_Job(tiff_job_t *rj);
+double TIFF_Time(void);
+void   TIFF_Stats_Add(tiff_stats_t *to, const tiff_stats_t *from);
+SEXP   TIFF_Timing_Info(const tiff_stats_t *st, double total);
+
+/* thread support: workers must not call R, use their own handles
+   and collect errors until the main thread can report them.
+   TIFF_Init() must have been called by the main thread. */
+TIFF *TIFF_Reopen(const tiff_job_t *rj, tiff_job_t *wj, toff_t dir); /* wj->stats set by the caller */
+TIFF *TIFF_Worker_Open(const char *fn, tiff_job_t *wj, const char *mode);
+TIFF *TIFF_Worker_Create(tiff_job_t *wj); /* in memory, for writing */
+void TIFF_Worker_Begin(void);
+int  TIFF_Worker_End(char *msg, size_t len);
 
 #endif
@@ -2,10 +2,22 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <math.h>
+#include <limits.h>
+#include <sys/stat.h>
 
 #include "common.h"
 
 #include <Rinternals.h>
+#include <Rversion.h>
+#include <R_ext/Rdynload.h>
+#if R_VERSION >= R_Version(3, 6, 0)
+#include <R_ext/Altrep.h>
+#endif
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 /* avoid protection issues with setAttrib where new symbols may trigger GC problems */
 static void setAttr(SEXP x, const char *name, SEXP val) {
@@ -14,13 +26,94 @@ static void setAttr(SEXP x, const char *name, SEXP val) {
     UNPROTECT(1);
 }
 
+/* names of enumerated tag values, uv is used for unknown values */
+static const char *sample_format_name(int v, char *uv, size_t len) {
+    switch (v) {
+    case 1: return "uint";
+    case 2: return "int";
+    case 3: return "float";
+    case 4: return "undefined";
+    case 5: return "complex int";
+    case 6: return "complex float";
+    }
+    snprintf(uv, len, "unknown (%d)", v);
+    return uv;
+}
+
+static const char *planar_config_name(int v, char *uv, size_t len) {
+    if (v == PLANARCONFIG_CONTIG)
+	return "contiguous";
+    if (v == PLANARCONFIG_SEPARATE)
+	return "separate";
+    snprintf(uv, len, "unknown (%d)", v);
+    return uv;
+}
+
+static const char *compression_name(int v, char *uv, size_t len) {
+    switch (v) {
+    case 1: return "none";
+    case 2: return "CCITT RLE";
+    case 32773: return "PackBits";
+    case 3: return "CCITT Group 3 fax";
+    case 4: return "CCITT Group 4 fax";
+    case 5: return "LZW";
+    case 6: return "old JPEG";
+    case 7: return "JPEG";
+    case 8: return "deflate";
+    case 9: return "JBIG b/w";
+    case 10: return "JBIG color";
+    }
+    snprintf(uv, len, "unknown (%d)", v);
+    return uv;
+}
+
+static const char *resolution_unit_name(int v, char *uv, size_t len) {
+    switch (v) {
+    case 1: return "none";
+    case 2: return "inch";
+    case 3: return "cm";
+    }
+    return "unknown";
+}
+
+static const char *orientation_name(int v, char *uv, size_t len) {
+    switch (v) {
+    case 1: return "top.left";
+    case 2: return "top.right";
+    case 3: return "bottom.right";
+    case 4: return "bottom.left";
+    case 5: return "left.top";
+    case 6: return "right.top";
+    case 7: return "right.bottom";
+    case 8: return "left.bottom";
+    }
+    return "<invalid>";
+}
+
+static const char *color_space_name(int v, char *uv, size_t len) {
+    switch (v) {
+    case 0: return "white is zero";
+    case 1: return "black is zero";
+    case 2: return "RGB";
+    case 3: return "palette";
+    case 4: return "mask";
+    case 5: return "separated";
+    case 6: return "YCbCr";
+    case 8: return "CIELAB";
+    case 9: return "ICCLab";
+    case 10: return "ITULab";
+    }
+    snprintf(uv, len, "unknown (%d)", v);
+    return uv;
+}
+
 /* add information attributes according to the TIFF tags.
    Only a somewhat random set (albeit mostly baseline) is supported */
 static void TIFF_add_info(TIFF *tiff, SEXP res) {
     uint32_t i32;
     uint16_t i16;
     float f;
-    char *c = 0;
+    char *c = 0, uv[24];
 
     if (TIFFGetField(tiff, TIFFTAG_IMAGEWIDTH, &i32))
 	setAttr(res, "width", ScalarInteger(i32));
@@ -32,33 +125,18 @@ static void TIFF_add_info(TIFF *tiff, SEXP res) {
 	setAttr(res, "bits.per.sample", ScalarInteger(i16));
     if (TIFFGetField(tiff, TIFFTAG_SAMPLESPERPIXEL, &i16))
 	setAttr(res, "samples.per.pixel", ScalarInteger(i16));
-    if (TIFFGetField(tiff, TIFFTAG_SAMPLEFORMAT, &i16)) {
-	char uv[24];
-	const char *name = 0;
-	switch (i16) {
-	case 1: name = "uint"; break;
-	case 2: name = "int"; break;
-	case 3: name = "float"; break;
-	case 4: name = "undefined"; break;
-	case 5: name = "complex int"; break;
-	case 6: name = "complex float"; break;
-	default:
-	    snprintf(uv, sizeof(uv), "unknown (%d)", i16);
-	    name = uv;
-	}
-	setAttr(res, "sample.format", mkString(name));
-	
-    }
-    if (TIFFGetField(tiff, TIFFTAG_PLANARCONFIG, &i16)) {
-	if (i16 == PLANARCONFIG_CONTIG)
-	    setAttr(res, "planar.config", mkString("contiguous"));
-	else if (i16 == PLANARCONFIG_SEPARATE)
-	    setAttr(res, "planar.config", mkString("separate"));
-	else {
-	    char uv[24];
-	    snprintf(uv, sizeof(uv), "unknown (%d)", i16);
-	    setAttr(res, "planar.config", mkString(uv));
-	}
+    if (TIFFGetField(tiff, TIFFTAG_SAMPLEFORMAT, &i16))
+	setAttr(res, "sample.format", mkString(sample_format_name(i16, uv, sizeof(uv))));
+    if (TIFFGetField(tiff, TIFFTAG_PLANARCONFIG, &i16))
+	setAttr(res, "planar.config", mkString(planar_config_name(i16, uv, sizeof(uv))));
+
+    if (TIFFGetField(tiff, TIFFTAG_SUBFILETYPE, &i32))
+	setAttr(res, "subfile.type", ScalarInteger(i32));
+    {
+	uint16_t n_sub = 0;
+	toff_t *sub = 0;
+	if (TIFFGetField(tiff, TIFFTAG_SUBIFD, &n_sub, &sub) && n_sub)
+	    setAttr(res, "sub.ifds", ScalarInteger(n_sub));
     }
 
     if (TIFFGetField(tiff, TIFFTAG_ROWSPERSTRIP, &i32))
@@ -70,27 +148,8 @@ static void TIFF_add_info(TIFF *tiff, SEXP res) {
         setAttr(res, "tile.length", ScalarInteger(i32));
     }
 
-    if (TIFFGetField(tiff, TIFFTAG_COMPRESSION, &i16)) {
-	char uv[24];
-	const char *name = 0;
-	switch (i16) {
-	case 1: name = "none"; break;
-	case 2: name = "CCITT RLE"; break;
-	case 32773: name = "PackBits"; break;
-	case 3: name = "CCITT Group 3 fax"; break;
-	case 4: name = "CCITT Group 4 fax"; break;
-	case 5: name = "LZW"; break;
-	case 6: name = "old JPEG"; break;
-	case 7: name = "JPEG"; break;
-	case 8: name = "deflate"; break;
-	case 9: name = "JBIG b/w"; break;
-	case 10: name = "JBIG color"; break;
-	default:
-	    snprintf(uv, sizeof(uv), "unknown (%d)", i16);
-	    name = uv;
-	}
-	setAttr(res, "compression", mkString(name));
-    }
+    if (TIFFGetField(tiff, TIFFTAG_COMPRESSION, &i16))
+	setAttr(res, "compression", mkString(compression_name(i16, uv, sizeof(uv))));
     if (TIFFGetField(tiff, TIFFTAG_THRESHHOLDING, &i16))
 	setAttr(res, "threshholding", ScalarInteger(i16));
     if (TIFFGetField(tiff, TIFFTAG_XRESOLUTION, &f))
@@ -101,33 +160,14 @@ static void TIFF_add_info(TIFF *tiff, SEXP res) {
 	setAttr(res, "x.position", ScalarReal(f));
     if (TIFFGetField(tiff, TIFFTAG_YPOSITION, &f))
 	setAttr(res, "y.position", ScalarReal(f));
-    if (TIFFGetField(tiff, TIFFTAG_RESOLUTIONUNIT, &i16)) {
-	const char *name = "unknown";
-	switch (i16) {
-	case 1: name = "none"; break;
-	case 2: name = "inch"; break;
-	case 3: name = "cm"; break;
-	}	    
-	setAttr(res, "resolution.unit", mkString(name));
-    }
+    if (TIFFGetField(tiff, TIFFTAG_RESOLUTIONUNIT, &i16))
+	setAttr(res, "resolution.unit", mkString(resolution_unit_name(i16, uv, sizeof(uv))));
 #ifdef TIFFTAG_INDEXED /* very recent in libtiff even though it's an old tag */
     if (TIFFGetField(tiff, TIFFTAG_INDEXED, &i16))
 	setAttr(res, "indexed", ScalarLogical(i16));
 #endif
-    if (TIFFGetField(tiff, TIFFTAG_ORIENTATION, &i16)) {
-	const char *name = "<invalid>";
-	switch (i16) {
-	case 1: name = "top.left"; break;
-	case 2: name = "top.right"; break;
-	case 3: name = "bottom.right"; break;
-	case 4: name = "bottom.left"; break;
-	case 5: name = "left.top"; break;
-	case 6: name = "right.top"; break;
-	case 7: name = "right.bottom"; break;
-	case 8: name = "left.bottom"; break;
-	}
-	setAttr(res, "orientation", mkString(name));
-    }
+    if (TIFFGetField(tiff, TIFFTAG_ORIENTATION, &i16))
+	setAttr(res, "orientation", mkString(orientation_name(i16, uv, sizeof(uv))));
     if (TIFFGetField(tiff, TIFFTAG_COPYRIGHT, &c) && c)
 	setAttr(res, "copyright", mkString(c));
     if (TIFFGetField(tiff, TIFFTAG_ARTIST, &c) && c)
@@ -140,42 +180,1856 @@ static void TIFF_add_info(TIFF *tiff, SEXP res) {
 	setAttr(res, "description", mkString(c));
     if (TIFFGetField(tiff, TIFFTAG_SOFTWARE, &c) && c)
 	setAttr(res, "software", mkString(c));
-    if (TIFFGetField(tiff, TIFFTAG_PHOTOMETRIC, &i16)) {
-	char uv[24];
-	const char *name = 0;
-	switch (i16) {
-	case 0: name = "white is zero"; break;
-	case 1: name = "black is zero"; break;
-	case 2: name = "RGB"; break;
-	case 3: name = "palette"; break;
-	case 4: name = "mask"; break;
-	case 5: name = "separated"; break;
-	case 6: name = "YCbCr"; break;
-	case 8: name = "CIELAB"; break;
-	case 9: name = "ICCLab"; break;
-	case 10: name = "ITULab"; break;
-	default:
-	    snprintf(uv, sizeof(uv), "unknown (%d)", i16);
-	    name = uv;
-	}
-	setAttr(res, "color.space", mkString(name));
+    if (TIFFGetField(tiff, TIFFTAG_PHOTOMETRIC, &i16))
+	setAttr(res, "color.space", mkString(color_space_name(i16, uv, sizeof(uv))));
+}
+
+/* resolution levels of an image: level 0 is the image itself, the
+   others are its SubIFDs and reduced-resolution images that directly
+   follow it in the main chain */
+typedef struct tiff_level {
+    toff_t offset;
+    uint32_t width, length;
+    int page, subifd, tiled;
+} tiff_level_t;
+
+#define MAX_LEVELS 64
+
+static int add_level(TIFF *tiff, tiff_level_t *lv, int n, int page, int subifd) {
+    lv[n].offset = TIFFCurrentDirOffset(tiff);
+    lv[n].width = lv[n].length = 0;
+    TIFFGetField(tiff, TIFFTAG_IMAGEWIDTH, &lv[n].width);
+    TIFFGetField(tiff, TIFFTAG_IMAGELENGTH, &lv[n].length);
+    lv[n].page = page;
+    lv[n].subifd = subifd;
+    lv[n].tiled = TIFFIsTiled(tiff);
+    return n + 1;
+}
+
+static int is_reduced(TIFF *tiff) {
+    uint32_t sft = 0;
+    return TIFFGetField(tiff, TIFFTAG_SUBFILETYPE, &sft) && (sft & FILETYPE_REDUCEDIMAGE);
+}
+
+/* collect the levels of the current image (page is its 1-based index)
+   sorted by decreasing width. The current directory is restored. */
+static int collect_levels(TIFF *tiff, int page, tiff_level_t *lv) {
+    toff_t base = TIFFCurrentDirOffset(tiff), sub[MAX_LEVELS];
+    toff_t *subp = 0;
+    uint16_t n_sub = 0, i;
+    int n = add_level(tiff, lv, 0, page, 0), j;
+
+    if (TIFFGetField(tiff, TIFFTAG_SUBIFD, &n_sub, &subp) && n_sub) {
+	if (n_sub > MAX_LEVELS - 1) n_sub = MAX_LEVELS - 1;
+	/* the array belongs to the directory so copy it */
+	memcpy(sub, subp, n_sub * sizeof(toff_t));
     }
+    while (n < MAX_LEVELS && TIFFReadDirectory(tiff) && is_reduced(tiff))
+	n = add_level(tiff, lv, n, ++page, 0);
+    for (i = 0; i < n_sub && n < MAX_LEVELS; i++)
+	if (TIFFSetSubDirectory(tiff, sub[i]))
+	    n = add_level(tiff, lv, n, lv[0].page, i + 1);
+    TIFFSetSubDirectory(tiff, base);
+
+    /* insertion sort by width, stable so the file order is kept for ties */
+    for (j = 1; j < n; j++) {
+	tiff_level_t l = lv[j];
+	int k = j;
+	while (k > 1 && lv[k - 1].width < l.width) {
+	    lv[k] = lv[k - 1];
+	    k--;
+	}
+	lv[k] = l;
+    }
+    return n;
 }
 
-SEXP read_tiff(SEXP sFn, SEXP sNative, SEXP sAll, SEXP sConvert, SEXP sInfo, SEXP sIndexed, SEXP sOriginal,
-	       SEXP sPayload) {
+/* switch to the requested level of the current image: either level
+   (0-based) or the smallest level at least min_width pixels wide. */
+static void select_level(TIFF *tiff, int page, int level, int min_width) {
+    tiff_level_t lv[MAX_LEVELS];
+    int n = collect_levels(tiff, page, lv), sel = 0;
+
+    if (level != NA_INTEGER)
+	sel = (level < n) ? level : (n - 1);
+    else if (min_width != NA_INTEGER)
+	while (sel + 1 < n && lv[sel + 1].width >= min_width)
+	    sel++;
+    if (sel > 0)
+	TIFFSetSubDirectory(tiff, lv[sel].offset);
+}
+
+/* close the TIFF unless it belongs to a handle. Errors and warnings
+   collected from libtiff since the last call are raised (see
+   TIFF_Errors()) once it is closed, since a warning can turn into an
+   error (options(warn=2)). The job belongs to the caller (or handle) so
+   it outlives the TIFF. */
+static void release_source(TIFF *tiff, tiff_handle_t *h) {
+    char msg[512];
+    tiff_job_t *rj = (tiff_job_t*) TIFFClientdata(tiff);
+    if (!h)
+	TIFFClose(tiff);
+    if (TIFF_Errors(rj, msg, sizeof(msg)))
+	Rf_error("%s", msg);
+}
+
+/* raise the errors libtiff reported so far, releasing the source */
+static void check_source(TIFF *tiff, tiff_handle_t *h) {
+    if (((tiff_job_t*) TIFFClientdata(tiff))->errors)
+	release_source(tiff, h);
+}
+
+/* state of a direct-mode decode: the window of the image that is
+   returned (in image pixel coordinates), the strip/tile layout and
+   the sample layout */
+typedef struct decode decode_t;
+
+/* see the row kernels below */
+typedef void (*row_kernel_t)(const decode_t *d, const unsigned char *row, tsize_t row_bytes,
+			     uint32_t rows, tsize_t i0, uint32_t n, uint16_t spp, R_xlen_t o, uint16_t plane);
+
+struct decode {
+    uint32_t x, y, width, height; /* output window */
+    int tiled;
+    uint32_t cw, ch;       /* chunk (tile or strip) size in pixels */
+    uint32_t group;        /* number of strips decoded together into one band */
+    uint16_t cspp, planes; /* samples per pixel in a chunk, number of planes */
+    tsize_t row_bytes, chunk_bytes;
+    uint16_t bps, out_spp;
+    int is_float, is_signed, indexed, ix_base;
+    double scale; /* divisor of packed integer samples for real output */
+    int native; /* 8-bit gray/RGB packed into a nativeRaster in ia: 1 + alpha type */
+    uint16_t *colormap[3];
+    uint32_t colors; /* number of entries in the color map */
+    /* exactly one of the following is set depending on the output type */
+    double *ra;
+    int *ia;
+    Rbyte *rw;
+    row_kernel_t kernel; /* converts decoded rows into the output */
+};
+
+/* output storage types (output= in readTIFF) */
+#define OUT_DOUBLE  0
+#define OUT_INTEGER 1
+#define OUT_RAW     2
+
+/* fetch the i-th sample of 1 to 16 bits from a row of samples packed
+   MSB first (the sample spans at most three bytes) */
+static unsigned int fetch_bits(const unsigned char *row, tsize_t i, int bps) {
+    uint64_t bit = (uint64_t) i * bps;
+    const unsigned char *v = row + (bit >> 3);
+    unsigned int n = (unsigned int) (bit & 7) + bps, w = v[0];
+    if (n > 8)
+	w = (w << 8) | v[1];
+    if (n > 16)
+	w = (w << 8) | v[2];
+    return (w >> (((n + 7) & ~7u) - n)) & ((1u << bps) - 1);
+}
+
+/* fetch the i-th (unscaled) integer sample from a decoded row */
+static unsigned int fetch_sample(const unsigned char *row, tsize_t i, int bps) {
+    switch (bps) {
+    case 8: return row[i];
+    case 16: return ((const unsigned short int*)row)[i];
+    case 32: return ((const unsigned int*)row)[i];
+    }
+    return fetch_bits(row, i, bps);
+}
+
+/* IEEE half precision to double by re-biasing into a float */
+static double half_to_double(unsigned int h) {
+    unsigned int e = (h >> 10) & 0x1f, m = h & 0x3ff;
+    union { uint32_t u; float f; } v;
+    if (!e) /* zero or subnormal */
+	return ldexp((double) m, -24) * ((h & 0x8000) ? -1.0 : 1.0);
+    v.u = ((h & 0x8000u) << 16) | ((e == 31) ? 0x7f800000u : ((e + 112) << 23)) | (m << 13);
+    return (double) v.f;
+}
+
+/* Row kernels convert a band of decoded rows (row_bytes apart) into
+   the output: n consecutive pixels starting at sample i0 of each of the
+   rows. Pixel k of row r goes to o + k * height + r in each of the spp
+   output planes starting at plane. The band is transposed column by
+   column so the output is written in contiguous runs of rows while the
+   few input rows stay in the cache. A kernel is selected once per image
+   so the inner loops don't branch on the sample format. */
+#define ROW_KERNEL(NAME, ITYPE, OTYPE, OUT, CONV)			\
+static void NAME(const decode_t *d, const unsigned char *row, tsize_t row_bytes, \
+		 uint32_t rows, tsize_t i0, uint32_t n, uint16_t spp,	\
+		 R_xlen_t o, uint16_t plane) {				\
+    R_xlen_t h = d->height, plane_size = (R_xlen_t) d->width * h;	\
+    const int base = d->ix_base;					\
+    uint32_t k, r;							\
+    uint16_t j;								\
+    (void) base;							\
+    for (j = 0; j < spp; j++)						\
+	for (k = 0; k < n; k++) {					\
+	    const unsigned char *src = row + (i0 + j + (tsize_t) k * spp) * sizeof(ITYPE); \
+	    OTYPE *dst = d->OUT + o + (plane + j) * plane_size + (R_xlen_t) k * h; \
+	    for (r = 0; r < rows; r++, src += row_bytes) {		\
+		ITYPE v = *((const ITYPE*) src);			\
+		dst[r] = CONV;						\
+	    }								\
+	}								\
+}
+
+ROW_KERNEL(row_u8_real,  unsigned char,      double, ra, ((double) v) / 255.0)
+ROW_KERNEL(row_u16_real, unsigned short int, double, ra, ((double) v) / 65535.0)
+ROW_KERNEL(row_u32_real, unsigned int,       double, ra, ((double) v) / 4294967296.0)
+ROW_KERNEL(row_f32_real, float,              double, ra, (double) v)
+ROW_KERNEL(row_u8_int,   unsigned char,      int,    ia, (int) v + base)
+ROW_KERNEL(row_u16_int,  unsigned short int, int,    ia, (int) v + base)
+ROW_KERNEL(row_u32_int,  unsigned int,       int,    ia, (v > (unsigned int) (INT_MAX - base)) ? NA_INTEGER : (int) (v + base))
+ROW_KERNEL(row_u8_raw,   unsigned char,      Rbyte,  rw, (Rbyte) v)
+ROW_KERNEL(row_s8_real,  signed char,        double, ra, ((double) v) / 128.0)
+ROW_KERNEL(row_s16_real, short int,          double, ra, ((double) v) / 32768.0)
+ROW_KERNEL(row_s32_real, int,                double, ra, ((double) v) / 2147483648.0)
+ROW_KERNEL(row_s8_int,   signed char,        int,    ia, (int) v)
+ROW_KERNEL(row_s16_int,  short int,          int,    ia, (int) v)
+ROW_KERNEL(row_s32_int,  int,                int,    ia, v) /* INT_MIN is NA */
+ROW_KERNEL(row_f16_real, unsigned short int, double, ra, half_to_double(v))
+ROW_KERNEL(row_f64_real, double,             double, ra, v)
+
+/* nativeRaster kernels pack 8-bit samples into top-down ABGR words
+   the same way libtiff's RGBA interface does, so o is a row-major
+   offset and the rows of the band are width apart in the output */
+#define NATIVE_KERNEL(NAME, PACK)					\
+static void NAME(const decode_t *d, const unsigned char *row, tsize_t row_bytes, \
+		 uint32_t rows, tsize_t i0, uint32_t n, uint16_t spp,	\
+		 R_xlen_t o, uint16_t plane) {				\
+    uint32_t k, r;							\
+    for (r = 0; r < rows; r++, row += row_bytes) {			\
+	const unsigned char *p = row + i0;				\
+	unsigned int *dst = (unsigned int*) d->ia + o + (R_xlen_t) r * d->width; \
+	for (k = 0; k < n; k++, p += spp)				\
+	    dst[k] = PACK;						\
+    }									\
+}
+
+/* unassociated alpha is pre-multiplied */
+#define UA(V, A) (((unsigned int) (V) * (A) + 127) / 255)
+
+NATIVE_KERNEL(row_native_gray, p[0] | (p[0] << 8) | (p[0] << 16) | 0xff000000u)
+NATIVE_KERNEL(row_native_ga,   p[0] | (p[0] << 8) | (p[0] << 16) | ((unsigned int) p[1] << 24))
+NATIVE_KERNEL(row_native_rgb,  p[0] | (p[1] << 8) | (p[2] << 16) | 0xff000000u)
+NATIVE_KERNEL(row_native_rgba, p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int) p[3] << 24))
+NATIVE_KERNEL(row_native_rgbua, UA(p[0], p[3]) | (UA(p[1], p[3]) << 8) | (UA(p[2], p[3]) << 16) |
+	      ((unsigned int) p[3] << 24))
+
+/* samples of other bit depths are packed, so they are fetched one by
+   one. Signed samples are sign-extended from the top bit. */
+static void row_bits(const decode_t *d, const unsigned char *row, tsize_t row_bytes,
+		     uint32_t rows, tsize_t i0, uint32_t n, uint16_t spp, R_xlen_t o, uint16_t plane) {
+    R_xlen_t h = d->height, plane_size = (R_xlen_t) d->width * h;
+    int bps = d->bps, sgn = d->is_signed ? (1 << (bps - 1)) : 0, base = d->ix_base;
+    double scale = d->scale;
+    uint32_t k, r;
+    uint16_t j;
+    for (j = 0; j < spp; j++)
+	for (k = 0; k < n; k++) {
+	    R_xlen_t p = o + (plane + j) * plane_size + (R_xlen_t) k * h;
+	    tsize_t i = i0 + j + (tsize_t) k * spp;
+	    const unsigned char *src = row;
+	    if (d->ia) {
+		int *dst = d->ia + p;
+		for (r = 0; r < rows; r++, src += row_bytes)
+		    dst[r] = ((int) fetch_bits(src, i, bps) ^ sgn) - sgn + base;
+	    } else if (d->rw) {
+		Rbyte *dst = d->rw + p;
+		for (r = 0; r < rows; r++, src += row_bytes)
+		    dst[r] = (Rbyte) fetch_bits(src, i, bps);
+	    } else {
+		double *dst = d->ra + p;
+		for (r = 0; r < rows; r++, src += row_bytes)
+		    dst[r] = ((double) (((int) fetch_bits(src, i, bps) ^ sgn) - sgn)) / scale;
+	    }
+	}
+}
+
+/* expand color map indices into out_spp (16-bit) color planes */
+static void row_palette(const decode_t *d, const unsigned char *row, tsize_t row_bytes,
+			uint32_t rows, tsize_t i0, uint32_t n, uint16_t spp, R_xlen_t o, uint16_t plane) {
+    R_xlen_t h = d->height, plane_size = (R_xlen_t) d->width * h;
+    uint32_t k, r;
+    uint16_t j;
+    for (j = 0; j < d->out_spp; j++) {
+	const uint16_t *cm = d->colormap[j];
+	for (k = 0; k < n; k++) {
+	    R_xlen_t p = o + j * plane_size + (R_xlen_t) k * h;
+	    tsize_t i = i0 + (tsize_t) k * spp;
+	    const unsigned char *src = row;
+	    for (r = 0; r < rows; r++, src += row_bytes) {
+		unsigned int ci = fetch_sample(src, i, d->bps);
+		if (d->ia)
+		    d->ia[p + r] = (ci < d->colors) ? cm[ci] : NA_INTEGER;
+		else if (d->rw)
+		    d->rw[p + r] = (ci < d->colors) ? (cm[ci] >> 8) : 0;
+		else
+		    d->ra[p + r] = (ci < d->colors) ? ((double) cm[ci]) / 65535.0 : NA_REAL;
+	    }
+	}
+    }
+}
+
+/* pick the row kernel for the sample format and output type of d */
+static row_kernel_t select_kernel(const decode_t *d) {
+    if (d->native) {
+	int alpha = d->native - 1;
+	if (d->out_spp < 3)
+	    return alpha ? row_native_ga : row_native_gray;
+	return (alpha == EXTRASAMPLE_UNASSALPHA) ? row_native_rgbua :
+	    (alpha ? row_native_rgba : row_native_rgb);
+    }
+    if (d->colormap[0] && !d->indexed)
+	return row_palette;
+    if (d->is_float)
+	return (d->bps == 16) ? row_f16_real : ((d->bps == 64) ? row_f64_real : row_f32_real);
+    if (d->bps != 8 && d->bps != 16 && d->bps != 32)
+	return row_bits;
+    if (d->is_signed) {
+	if (d->ia)
+	    return (d->bps == 8) ? row_s8_int : ((d->bps == 16) ? row_s16_int : row_s32_int);
+	return (d->bps == 8) ? row_s8_real : ((d->bps == 16) ? row_s16_real : row_s32_real);
+    }
+    if (d->rw)
+	return row_u8_raw;
+    if (d->ia)
+	return (d->bps == 8) ? row_u8_int : ((d->bps == 16) ? row_u16_int : row_u32_int);
+    switch (d->bps) {
+    case 8: return row_u8_real;
+    case 16: return row_u16_real;
+    }
+    return row_u32_real;
+}
+
+/* rows transposed at a time; strips are grouped into bands of up to that
+   many rows as long as the band fits into BAND_BYTES */
+#define BAND_ROWS  64
+#define BAND_BYTES (1 << 20)
+
+/* store the part of a decoded strip or tile that intersects the window.
+   The chunk covers the pixels [cx, cx + cw) x [cy, cy + ch), its rows are
+   row_bytes apart and n is the number of valid bytes in buf. spp is the
+   number of samples per pixel in the chunk and plane the first output
+   plane they belong to (non-zero only for separate planes). */
+static void store_chunk(decode_t *d, const unsigned char *buf, tsize_t n, tsize_t row_bytes,
+			uint32_t cx, uint32_t cy, uint32_t cw, uint32_t ch, uint16_t spp, uint16_t plane) {
+    uint32_t y, x0 = (cx > d->x) ? cx : d->x, y0 = (cy > d->y) ? cy : d->y,
+	x1 = cx + cw, y1 = cy + ch;
+
+    if (x1 > d->x + d->width) x1 = d->x + d->width;
+    if (y1 > d->y + d->height) y1 = d->y + d->height;
+    if (n < 0) n = 0;
+    if (y1 > cy + n / row_bytes) /* short chunk, use only complete rows */
+	y1 = cy + n / row_bytes;
+    if (x0 >= x1)
+	return;
+
+    for (y = y0; y < y1; y += BAND_ROWS)
+	d->kernel(d, buf + (y - cy) * row_bytes, row_bytes, (y1 - y > BAND_ROWS) ? BAND_ROWS : (y1 - y),
+		  (tsize_t) (x0 - cx) * spp, x1 - x0, spp,
+		  d->native ? (R_xlen_t) (y - d->y) * d->width + (x0 - d->x) :
+		  (R_xlen_t) (x0 - d->x) * d->height + (y - d->y), plane);
+}
+
+/* set up the chunk layout of the current directory */
+static void decode_layout(TIFF *tiff, decode_t *d, uint16_t spp, uint16_t config) {
+    uint32_t imageWidth = 0, imageLength = 0, rps = 0;
+
+    TIFFGetField(tiff, TIFFTAG_IMAGEWIDTH, &imageWidth);
+    TIFFGetField(tiff, TIFFTAG_IMAGELENGTH, &imageLength);
+    d->planes = (config == PLANARCONFIG_SEPARATE) ? spp : 1;
+    d->cspp = (d->planes > 1) ? 1 : spp;
+    d->group = 1;
+    if ((d->tiled = TIFFIsTiled(tiff))) {
+	TIFFGetField(tiff, TIFFTAG_TILEWIDTH, &d->cw);
+	TIFFGetField(tiff, TIFFTAG_TILELENGTH, &d->ch);
+	d->row_bytes = TIFFTileRowSize(tiff);
+	d->chunk_bytes = TIFFTileSize(tiff);
+    } else {
+	if (!TIFFGetField(tiff, TIFFTAG_ROWSPERSTRIP, &rps) || rps > imageLength)
+	    rps = imageLength;
+	d->cw = imageWidth;
+	d->ch = rps;
+	d->row_bytes = TIFFScanlineSize(tiff);
+	d->chunk_bytes = TIFFStripSize(tiff);
+	/* short strips are decoded in groups so the transpose sees enough rows */
+	if (rps < BAND_ROWS && d->chunk_bytes > 0) {
+	    d->group = (BAND_ROWS + rps - 1) / rps;
+	    if (d->group > BAND_BYTES / d->chunk_bytes)
+		d->group = BAND_BYTES / d->chunk_bytes;
+	    if (d->group < 1)
+		d->group = 1;
+	}
+    }
+#ifdef TIFF_DEBUG
+    Rprintf(" - %d x %d %s\n", d->tiled ? TIFFNumberOfTiles(tiff) : TIFFNumberOfStrips(tiff),
+	    d->chunk_bytes, d->tiled ? "tiles" : "strips");
+#endif
+}
+
+/* chunks (tiles or groups of strips) intersecting the window are
+   numbered plane by plane, row by row; nx is the number of chunks across
+   the window. buf must hold d->group strips. */
+static void decode_chunk(TIFF *tiff, decode_t *d, tdata_t buf, int k, int nx, int ny) {
+    uint16_t plane = k / (nx * ny);
+    uint32_t x = (d->x / d->cw) * d->cw + (k % nx) * d->cw,
+	y = (d->y / d->ch) * d->ch + ((k / nx) % ny) * d->ch * d->group, i = 1;
+    tsize_t n = 0, strip_bytes = (tsize_t) d->ch * d->row_bytes;
+    tiff_stats_t *st = ((tiff_job_t*) TIFFClientdata(tiff))->stats;
+    double t0 = 0, t1 = 0, io = 0;
+    if (st) {
+	t0 = TIFF_Time();
+	io = st->io;
+    }
+    if (d->tiled)
+	n = TIFFReadTile(tiff, buf, x, y, 0 /*depth*/, plane);
+    else /* consecutive strips form one band of complete rows */
+	for (i = 0; i < d->group && y + i * d->ch < d->y + d->height; i++) {
+	    tsize_t m = TIFFReadEncodedStrip(tiff, TIFFComputeStrip(tiff, y + i * d->ch, plane),
+					     (unsigned char*) buf + i * strip_bytes, (tsize_t) -1);
+	    if (m > 0)
+		n += m;
+	    if (m < strip_bytes) { /* the last or a broken strip */
+		i++;
+		break;
+	    }
+	}
+    if (st) {
+	t1 = TIFF_Time();
+	st->codec += (t1 - t0) - (st->io - io); /* without the reads */
+	st->chunks += i;
+    }
+    store_chunk(d, (const unsigned char*) buf, n, d->row_bytes, x, y, d->cw, d->ch * d->group, d->cspp, plane);
+    if (st)
+	st->convert += TIFF_Time() - t1;
+}
+
+#ifdef _OPENMP
+/* decode chunks in parallel, each worker uses its own handle and buffer
+   and writes into disjoint parts of the output.
+   Returns non-zero on failure with the message in err. */
+static int decode_parallel(TIFF *tiff, const tiff_job_t *rj, decode_t *d, int nx, int ny, int threads,
+			   char *err, size_t err_len) {
+    toff_t dir = TIFFCurrentDirOffset(tiff);
+    int failed = 0, n = nx * ny * d->planes;
+    tiff_stats_t *st = ((tiff_job_t*) TIFFClientdata(tiff))->stats;
+
+#pragma omp parallel num_threads(threads)
+    {
+	tiff_job_t wj;
+	tiff_stats_t ws; /* merged into st at the end */
+	TIFF *wt;
+	tdata_t buf = 0;
+	char msg[512];
+	int k;
+
+	memset(&ws, 0, sizeof(ws));
+	wj.stats = st ? &ws : 0;
+	TIFF_Worker_Begin();
+	if ((wt = TIFF_Reopen(rj, &wj, dir)))
+	    buf = _TIFFmalloc(d->chunk_bytes * d->group);
+#pragma omp for schedule(dynamic)
+	for (k = 0; k < n; k++)
+	    if (buf)
+		decode_chunk(wt, d, buf, k, nx, ny);
+	if (buf)
+	    _TIFFfree(buf);
+	if (wt)
+	    TIFFClose(wt);
+	if (st) {
+#pragma omp critical
+	    TIFF_Stats_Add(st, &ws);
+	}
+	msg[0] = 0;
+	if (TIFF_Worker_End(msg, sizeof(msg)) || !buf) {
+#pragma omp critical
+	    if (!failed++)
+		snprintf(err, err_len, "%s", msg[0] ? msg : "unable to set up a decoding thread");
+	}
+    }
+    return failed;
+}
+#endif
+
+/* the buffer of serial decodes is kept for the next image so repeated
+   reads don't allocate, unless it is larger than KEEP_BUFFER */
+#define KEEP_BUFFER (4 << 20)
+
+static tdata_t decode_buf;
+static tsize_t decode_buf_size;
+
+static tdata_t get_decode_buffer(TIFF *tiff, tiff_handle_t *h, tsize_t size) {
+    if (size > decode_buf_size) {
+	if (decode_buf)
+	    _TIFFfree(decode_buf);
+	decode_buf_size = 0;
+	if (!(decode_buf = _TIFFmalloc(size))) {
+	    release_source(tiff, h);
+	    Rf_error("unable to allocate decode buffer");
+	}
+	decode_buf_size = size;
+    }
+    return decode_buf;
+}
+
+static void put_decode_buffer(void) {
+    if (decode_buf_size > KEEP_BUFFER) {
+	_TIFFfree(decode_buf);
+	decode_buf = 0;
+	decode_buf_size = 0;
+    }
+}
+
+/* decode all strips or tiles intersecting the window using up to threads threads */
+static void decode_image(TIFF *tiff, const tiff_job_t *rj, tiff_handle_t *h, decode_t *d, int threads) {
+    uint32_t band = d->ch * d->group;
+    int nx = (d->x + d->width - (d->x / d->cw) * d->cw + d->cw - 1) / d->cw,
+	ny = (d->y + d->height - (d->y / d->ch) * d->ch + band - 1) / band,
+	n = nx * ny * d->planes, k;
+    tdata_t buf;
+    tiff_stats_t *st = ((tiff_job_t*) TIFFClientdata(tiff))->stats;
+
+    d->kernel = select_kernel(d);
+#ifdef _OPENMP
+    if (threads > n)
+	threads = n;
+    if (threads > 1) {
+	char err[512];
+	if (st && (double) d->chunk_bytes * d->group * threads > st->scratch)
+	    st->scratch = (double) d->chunk_bytes * d->group * threads;
+	if (decode_parallel(tiff, rj, d, nx, ny, threads, err, sizeof(err))) {
+	    release_source(tiff, h);
+	    Rf_error("%s", err);
+	}
+	return;
+    }
+#endif
+    if (st && (double) d->chunk_bytes * d->group > st->scratch)
+	st->scratch = (double) d->chunk_bytes * d->group;
+    buf = get_decode_buffer(tiff, h, d->chunk_bytes * d->group);
+    for (k = 0; k < n; k++)
+	decode_chunk(tiff, d, buf, k, nx, ny);
+    put_decode_buffer();
+}
+
+/* check whether the current directory can be packed into a nativeRaster
+   directly: 8-bit contiguous gray, gray+alpha, RGB or RGBA in the default
+   orientation. Returns 1 + the alpha type as used by libtiff's RGBA
+   interface (0 for none) or 0 if the RGBA interface has to be used. */
+static int native_layout(TIFF *tiff) {
+    uint16_t bps = 0, spp = 1, config = PLANARCONFIG_CONTIG, sformat = SAMPLEFORMAT_UINT,
+	photo, orient = ORIENTATION_TOPLEFT, extra = 0, *sinfo = 0, *cm[3];
+    int alpha = 0;
+
+    TIFFGetField(tiff, TIFFTAG_BITSPERSAMPLE, &bps);
+    TIFFGetField(tiff, TIFFTAG_SAMPLESPERPIXEL, &spp);
+    TIFFGetField(tiff, TIFFTAG_PLANARCONFIG, &config);
+    TIFFGetField(tiff, TIFFTAG_SAMPLEFORMAT, &sformat);
+    TIFFGetField(tiff, TIFFTAG_ORIENTATION, &orient);
+    if (bps != 8 || sformat != SAMPLEFORMAT_UINT || orient != ORIENTATION_TOPLEFT ||
+	(config != PLANARCONFIG_CONTIG && spp > 1) ||
+	TIFFGetField(tiff, TIFFTAG_COLORMAP, cm, cm + 1, cm + 2) ||
+	!TIFFGetField(tiff, TIFFTAG_PHOTOMETRIC, &photo))
+	return 0;
+    if (!((photo == PHOTOMETRIC_MINISBLACK && spp <= 2) ||
+	  (photo == PHOTOMETRIC_RGB && (spp == 3 || spp == 4))))
+	return 0;
+    /* same rules as TIFFRGBAImageBegin() */
+    if (TIFFGetField(tiff, TIFFTAG_EXTRASAMPLES, &extra, &sinfo) && extra > 0) {
+	if (sinfo[0] == EXTRASAMPLE_ASSOCALPHA || sinfo[0] == EXTRASAMPLE_UNASSALPHA)
+	    alpha = sinfo[0];
+	else if (sinfo[0] == EXTRASAMPLE_UNSPECIFIED && spp > 3)
+	    alpha = EXTRASAMPLE_ASSOCALPHA;
+    }
+    /* gray is never pre-multiplied, alpha of RGB needs the fourth sample */
+    if (photo == PHOTOMETRIC_MINISBLACK) {
+	if (spp < 2)
+	    alpha = 0;
+	else if (alpha)
+	    alpha = EXTRASAMPLE_ASSOCALPHA;
+    } else if (spp < 4)
+	alpha = 0;
+    return 1 + alpha;
+}
+
+/* read a window of the image via the RGBA interface (bottom-up raster).
+   libtiff only handles column offsets correctly for 8-bit contiguous
+   samples, so we always read full-width rows and crop them ourselves.
+   For timing all of it counts as decompression. Returns 0 on failure
+   with the error reported to the TIFF (use check_source()). */
+static int read_rgba(TIFF *tiff, uint32_t *raster, uint32_t x, uint32_t y, uint32_t width, uint32_t height) {
+    TIFFRGBAImage img;
+    char emsg[1024];
+    int ok = 0;
+    tiff_stats_t *st = ((tiff_job_t*) TIFFClientdata(tiff))->stats;
+    double t0 = st ? TIFF_Time() : 0, io = st ? st->io : 0;
+    if (TIFFRGBAImageOK(tiff, emsg) && TIFFRGBAImageBegin(&img, tiff, 0, emsg)) {
+	uint32_t *band = raster, i;
+	if (width != img.width) {
+	    band = (uint32_t*) _TIFFmalloc((tsize_t) img.width * height * sizeof(uint32_t));
+	    if (st && (double) img.width * height * sizeof(uint32_t) > st->scratch)
+		st->scratch = (double) img.width * height * sizeof(uint32_t);
+	}
+	if (band) {
+	    img.row_offset = y;
+	    if (!(ok = TIFFRGBAImageGet(&img, band, img.width, height)))
+		snprintf(emsg, sizeof(emsg), "unable to read the image");
+	    if (band != raster) {
+		for (i = 0; i < height; i++)
+		    memcpy(raster + (tsize_t) i * width, band + (tsize_t) i * img.width + x, width * sizeof(uint32_t));
+		_TIFFfree(band);
+	    }
+	} else
+	    snprintf(emsg, sizeof(emsg), "unable to allocate RGBA buffer of %u x %u pixels", img.width, height);
+	TIFFRGBAImageEnd(&img);
+    }
+    /* errors libtiff reported in TIFFRGBAImageGet() come first */
+    if (!ok)
+	TIFF_Error(tiff, TIFFFileName(tiff), "%s", emsg);
+    if (st)
+	st->codec += (TIFF_Time() - t0) - (st->io - io);
+    return ok;
+}
+
+/* clip the requested region to the image, returns 0 if nothing is left */
+static int clip_region(const int *region, uint32_t imageWidth, uint32_t imageLength,
+		       uint32_t *x, uint32_t *y, uint32_t *width, uint32_t *height) {
+    double x0 = 0, y0 = 0, x1 = imageWidth, y1 = imageLength;
+    if (region) { /* x, y are 1-based */
+	if (region[0] - 1 > x0) x0 = region[0] - 1;
+	if (region[1] - 1 > y0) y0 = region[1] - 1;
+	if ((double) region[0] - 1 + region[2] < x1) x1 = (double) region[0] - 1 + region[2];
+	if ((double) region[1] - 1 + region[3] < y1) y1 = (double) region[1] - 1 + region[3];
+    }
+    if (x1 <= x0 || y1 <= y0)
+	return 0;
+    *x = (uint32_t) x0;
+    *y = (uint32_t) y0;
+    *width = (uint32_t) (x1 - x0);
+    *height = (uint32_t) (y1 - y0);
+    return 1;
+}
+
+/* open the source which is either a file name or a raw vector */
+static TIFF *open_source(SEXP sFn, tiff_job_t *rj) {
+    TIFF *tiff;
+    if (TYPEOF(sFn) == RAWSXP) {
+	rj->data = (char*) RAW(sFn);
+	rj->len = LENGTH(sFn);
+	rj->alloc = rj->ptr = 0;
+	rj->f = 0;
+    } else {
+	const char *fn;
+	if (TYPEOF(sFn) != STRSXP || LENGTH(sFn) < 1) Rf_error("invalid filename");
+	fn = CHAR(STRING_ELT(sFn, 0));
+	rj->f = fopen(fn, "rb");
+	if (!rj->f) Rf_error("unable to open %s", fn);
+	rj->fn = fn;
+    }
+
+    tiff = TIFF_Open("rc", rj); /* mmap if possible, no chopping */
+    if (!tiff) {
+	char msg[512];
+	if (TIFF_Errors(rj, msg, sizeof(msg)))
+	    Rf_error("%s", msg);
+	Rf_error("Unable to open TIFF");
+    }
+    return tiff;
+}
+
+/* the external pointer of a handle is cleared when it is closed */
+static tiff_handle_t *handle_of(SEXP sH) {
+    tiff_handle_t *h;
+    if (TYPEOF(sH) != EXTPTRSXP || !inherits(sH, "TIFFhandle"))
+	Rf_error("invalid TIFF handle");
+    if (!(h = (tiff_handle_t*) R_ExternalPtrAddr(sH)) || !h->tiff)
+	Rf_error("TIFF handle is closed");
+    if (h->writing)
+	Rf_error("TIFF handle is open for writing");
+    return h;
+}
+
+/* like open_source() but also accepts handles in which case *h is set,
+   rj receives a copy of its job and the TIFF is positioned at the first
+   image if rewind is set. Use release_source() when done. */
+static TIFF *get_source(SEXP sFn, tiff_job_t *rj, tiff_handle_t **h, int rewind) {
+    if (TYPEOF(sFn) == EXTPTRSXP) {
+	*h = handle_of(sFn);
+	TIFF_Timing_Job(&(*h)->rj);
+	*rj = (*h)->rj;
+	if (rewind && TIFFCurrentDirOffset((*h)->tiff) != (*h)->first &&
+	    !TIFFSetSubDirectory((*h)->tiff, (*h)->first)) {
+	    check_source((*h)->tiff, *h);
+	    Rf_error("unable to read the first image");
+	}
+	return (*h)->tiff;
+    }
+    *h = 0;
+    return open_source(sFn, rj);
+}
+
+static void handle_fin(SEXP sH) {
+    tiff_handle_t *h = (tiff_handle_t*) R_ExternalPtrAddr(sH);
+    if (h) {
+	if (h->tiff)
+	    TIFFClose(h->tiff);
+	free(h->dirs);
+	free(h);
+	R_ClearExternalPtr(sH);
+    }
+}
+
+SEXP open_tiff(SEXP sFn, SEXP sWrite) {
+    tiff_handle_t *h = (tiff_handle_t*) calloc(1, sizeof(tiff_handle_t));
+    SEXP res;
+    if (!h)
+	Rf_error("unable to allocate TIFF handle");
+    /* the source is kept alive since the job refers to it */
+    res = PROTECT(R_MakeExternalPtr(h, R_NilValue, sFn));
+    R_RegisterCFinalizerEx(res, handle_fin, TRUE);
+    setAttrib(res, R_ClassSymbol, mkString("TIFFhandle"));
+    if (asInteger(sWrite) == 1) { /* images are added by writeTIFF() */
+	const char *fn;
+	char msg[512];
+	if (TYPEOF(sFn) != STRSXP || LENGTH(sFn) < 1)
+	    Rf_error("invalid filename");
+	fn = CHAR(STRING_ELT(sFn, 0));
+	if (!(h->rj.f = fopen(fn, "w+b")))
+	    Rf_error("unable to create %s", fn);
+	h->rj.fn = fn;
+	h->writing = 1;
+	if (!(h->tiff = TIFF_Open("wm", &h->rj))) {
+	    fclose(h->rj.f);
+	    if (TIFF_Errors(&h->rj, msg, sizeof(msg)))
+		Rf_error("%s", msg);
+	    Rf_error("cannot create TIFF structure");
+	}
+    } else
+	h->tiff = open_source(sFn, &h->rj);
+    TIFF_Keep(h->tiff);
+    h->first = TIFFCurrentDirOffset(h->tiff);
+    UNPROTECT(1);
+    return res;
+}
+
+/* closing a handle open for writing finishes the file, so the errors
+   of libtiff are reported as well as a file that is incomplete or has
+   no images (only the header is written) */
+SEXP close_tiff(SEXP sH) {
+    tiff_handle_t *h;
+    char msg[512];
+    int err = 0;
+    if (TYPEOF(sH) != EXTPTRSXP || !inherits(sH, "TIFFhandle"))
+	Rf_error("invalid TIFF handle");
+    if ((h = (tiff_handle_t*) R_ExternalPtrAddr(sH)) && h->tiff && h->writing) {
+	TIFFClose(h->tiff);
+	h->tiff = 0;
+	if (!(err = TIFF_Errors(&h->rj, msg, sizeof(msg)))) {
+	    if (h->failed)
+		snprintf(msg, sizeof(msg), "writing an image failed, %s is incomplete", h->rj.fn);
+	    else if (!h->pages)
+		snprintf(msg, sizeof(msg), "no images were written, %s is not a valid TIFF file", h->rj.fn);
+	    err = h->failed || !h->pages;
+	}
+    }
+    handle_fin(sH);
+    if (err)
+	Rf_error("%s", msg);
+    return R_NilValue;
+}
+
+/* lazy images (lazy=TRUE) are ALTREP vectors which decode the strips or
+   tiles of the image on access. Decoded chunks are kept in a cache of
+   limited size (option tiff.lazy.cache in bytes), the complete image is
+   only decoded when R asks for the data pointer. */
+#if R_VERSION >= R_Version(3, 6, 0)
+#define HAVE_LAZY 1
+
+#define LAZY_CACHE (64 << 20)
+
+typedef struct lazy_slot {
+    int chunk;             /* -1 if empty */
+    uint32_t x, y, w, h;   /* rectangle covered, relative to the window */
+    size_t size;
+    unsigned long used;    /* clock of the last use */
+    char *data;            /* out_spp planes of w x h in column-major order */
+} lazy_slot_t;
+
+typedef struct lazy {
+    tiff_handle_t h;       /* own handle positioned at the image */
+    decode_t dec;          /* output pointers are set per chunk */
+    SEXPTYPE type;
+    R_xlen_t len;
+    size_t esize;
+    int threads;
+    uint32_t gx, gy, band; /* origin and height of the chunk grid */
+    int nx, ny;
+    tdata_t buf;           /* decode buffer */
+    int *slot_of;          /* slot of each chunk or -1 */
+    lazy_slot_t *slots;
+    int n_slots, alloc_slots;
+    size_t bytes, limit;
+    unsigned long clock;
+} lazy_t;
+
+static R_altrep_class_t lazy_real, lazy_int, lazy_raw;
+
+/* release everything but the state itself (after materialization) */
+static void lazy_release(lazy_t *z) {
+    int i;
+    if (z->h.tiff)
+	TIFFClose(z->h.tiff);
+    z->h.tiff = 0;
+    if (z->buf)
+	_TIFFfree(z->buf);
+    z->buf = 0;
+    for (i = 0; i < z->n_slots; i++)
+	free(z->slots[i].data);
+    free(z->slots);
+    free(z->slot_of);
+    z->slots = 0;
+    z->slot_of = 0;
+    z->n_slots = z->alloc_slots = 0;
+    z->bytes = 0;
+}
+
+static void lazy_fin(SEXP ptr) {
+    lazy_t *z = (lazy_t*) R_ExternalPtrAddr(ptr);
+    if (z) {
+	lazy_release(z);
+	free(z);
+	R_ClearExternalPtr(ptr);
+    }
+}
+
+static lazy_t *lazy_of(SEXP x) {
+    return (lazy_t*) R_ExternalPtrAddr(R_altrep_data1(x));
+}
+
+static void lazy_set_output(decode_t *d, SEXPTYPE type, void *data) {
+    d->ra = 0;
+    d->ia = 0;
+    d->rw = 0;
+    if (type == INTSXP)
+	d->ia = (int*) data;
+    else if (type == RAWSXP)
+	d->rw = (Rbyte*) data;
+    else
+	d->ra = (double*) data;
+    d->kernel = select_kernel(d);
+}
+
+/* return the cache slot holding chunk c, decoding it if needed */
+static lazy_slot_t *lazy_chunk(lazy_t *z, int c) {
+    int k = z->slot_of[c], pl;
+    uint32_t x0 = z->gx + (c % z->nx) * z->dec.cw, y0 = z->gy + (c / z->nx) * z->band,
+	x1 = x0 + z->dec.cw, y1 = y0 + z->band;
+    size_t size;
+    lazy_slot_t *s;
+    decode_t d;
+
+    if (k >= 0) {
+	z->slots[k].used = ++z->clock;
+	return z->slots + k;
+    }
+    if (x0 < z->dec.x) x0 = z->dec.x;
+    if (y0 < z->dec.y) y0 = z->dec.y;
+    if (x1 > z->dec.x + z->dec.width) x1 = z->dec.x + z->dec.width;
+    if (y1 > z->dec.y + z->dec.height) y1 = z->dec.y + z->dec.height;
+    size = (size_t) (x1 - x0) * (y1 - y0) * z->dec.out_spp * z->esize;
+
+    /* use a new slot while within the limit, otherwise evict the least
+       recently used one */
+    if (!z->n_slots || z->bytes + size <= z->limit) {
+	if (z->n_slots == z->alloc_slots) {
+	    int na = z->alloc_slots ? z->alloc_slots * 2 : 16;
+	    lazy_slot_t *ns = (lazy_slot_t*) realloc(z->slots, sizeof(lazy_slot_t) * na);
+	    if (!ns)
+		Rf_error("unable to allocate the chunk cache");
+	    z->slots = ns;
+	    z->alloc_slots = na;
+	}
+	k = z->n_slots++;
+	memset(z->slots + k, 0, sizeof(lazy_slot_t));
+	z->slots[k].chunk = -1;
+    } else {
+	int i;
+	for (i = 1, k = 0; i < z->n_slots; i++)
+	    if (z->slots[i].used < z->slots[k].used)
+		k = i;
+    }
+    s = z->slots + k;
+    if (s->chunk >= 0)
+	z->slot_of[s->chunk] = -1;
+    s->chunk = -1;
+    if (s->size != size) {
+	char *nd = (char*) realloc(s->data, size);
+	if (!nd)
+	    Rf_error("unable to allocate the chunk cache");
+	z->bytes += size - s->size;
+	s->data = nd;
+	s->size = size;
+    }
+
+    /* decode the chunk (in all planes) with the window set to it */
+    memset(s->data, 0, size);
+    d = z->dec;
+    d.x = x0;
+    d.y = y0;
+    d.width = x1 - x0;
+    d.height = y1 - y0;
+    lazy_set_output(&d, z->type, s->data);
+    for (pl = 0; pl < d.planes; pl++)
+	decode_chunk(z->h.tiff, &d, z->buf, pl, 1, 1);
+    check_source(z->h.tiff, &z->h); /* the slot stays empty */
+
+    s->x = x0 - z->dec.x;
+    s->y = y0 - z->dec.y;
+    s->w = x1 - x0;
+    s->h = y1 - y0;
+    s->chunk = c;
+    s->used = ++z->clock;
+    z->slot_of[c] = k;
+    return s;
+}
+
+/* pointer to element i, run receives the number of elements that follow
+   contiguously (to the end of the chunk in the column) */
+static const char *lazy_at(lazy_t *z, R_xlen_t i, R_xlen_t *run) {
+    R_xlen_t H = z->dec.height, plane_size = (R_xlen_t) z->dec.width * H,
+	p = i / plane_size, rem = i % plane_size;
+    uint32_t col = (uint32_t) (rem / H), row = (uint32_t) (rem % H);
+    int kx = (z->dec.x + col - z->gx) / z->dec.cw, ky = (z->dec.y + row - z->gy) / z->band;
+    lazy_slot_t *s = lazy_chunk(z, ky * z->nx + kx);
+    *run = s->y + s->h - row;
+    return s->data + z->esize * ((R_xlen_t) p * s->w * s->h + (R_xlen_t) (col - s->x) * s->h + (row - s->y));
+}
+
+/* data of the materialized vector (DATAPTR() is not part of the API) */
+static void *lazy_data(const lazy_t *z, SEXP res) {
+    switch (z->type) {
+    case REALSXP: return REAL(res);
+    case INTSXP: return INTEGER(res);
+    default: return RAW(res);
+    }
+}
+
+static SEXP lazy_materialize(SEXP x) {
+    SEXP res = R_altrep_data2(x);
+    if (res == R_NilValue) {
+	lazy_t *z = lazy_of(x);
+	decode_t d = z->dec;
+	res = PROTECT(allocVector(z->type, z->len));
+	lazy_set_output(&d, z->type, lazy_data(z, res));
+	decode_image(z->h.tiff, &z->h.rj, &z->h, &d, z->threads);
+	check_source(z->h.tiff, &z->h);
+	R_set_altrep_data2(x, res);
+	lazy_release(z);
+	UNPROTECT(1);
+    }
+    return res;
+}
+
+static R_xlen_t lazy_Length(SEXP x) {
+    return lazy_of(x)->len;
+}
+
+static Rboolean lazy_Inspect(SEXP x, int pre, int deep, int pvec, void (*inspect_subtree)(SEXP, int, int, int)) {
+    lazy_t *z = lazy_of(x);
+    if (R_altrep_data2(x) != R_NilValue)
+	Rprintf(" lazy TIFF image (materialized)\n");
+    else
+	Rprintf(" lazy TIFF image, %d of %.0f chunks cached (%.1f MB)\n", z->n_slots, (double) z->nx * z->ny,
+		((double) z->bytes) / 1048576.0);
+    return TRUE;
+}
+
+static void *lazy_Dataptr(SEXP x, Rboolean writeable) {
+    return lazy_data(lazy_of(x), lazy_materialize(x));
+}
+
+static const void *lazy_Dataptr_or_null(SEXP x) {
+    SEXP res = R_altrep_data2(x);
+    return (res == R_NilValue) ? 0 : lazy_data(lazy_of(x), res);
+}
+
+/* copies up to n elements from i on into buf */
+static R_xlen_t lazy_region(SEXP x, R_xlen_t i, R_xlen_t n, void *buf) {
+    lazy_t *z = lazy_of(x);
+    SEXP res = R_altrep_data2(x);
+    R_xlen_t done = 0, run;
+    if (i + n > z->len)
+	n = z->len - i;
+    if (res != R_NilValue) {
+	memcpy(buf, (char*) lazy_data(z, res) + z->esize * i, z->esize * n);
+	return n;
+    }
+    while (done < n) {
+	const char *src = lazy_at(z, i + done, &run);
+	if (run > n - done)
+	    run = n - done;
+	memcpy((char*) buf + z->esize * done, src, z->esize * run);
+	done += run;
+    }
+    return n;
+}
+
+static double lazy_real_Elt(SEXP x, R_xlen_t i) {
+    SEXP res = R_altrep_data2(x);
+    R_xlen_t run;
+    return (res != R_NilValue) ? REAL(res)[i] : *((const double*) lazy_at(lazy_of(x), i, &run));
+}
+
+static int lazy_int_Elt(SEXP x, R_xlen_t i) {
+    SEXP res = R_altrep_data2(x);
+    R_xlen_t run;
+    return (res != R_NilValue) ? INTEGER(res)[i] : *((const int*) lazy_at(lazy_of(x), i, &run));
+}
+
+static Rbyte lazy_raw_Elt(SEXP x, R_xlen_t i) {
+    SEXP res = R_altrep_data2(x);
+    R_xlen_t run;
+    return (res != R_NilValue) ? RAW(res)[i] : *((const Rbyte*) lazy_at(lazy_of(x), i, &run));
+}
+
+static R_xlen_t lazy_real_Get_region(SEXP x, R_xlen_t i, R_xlen_t n, double *buf) {
+    return lazy_region(x, i, n, buf);
+}
+
+static R_xlen_t lazy_int_Get_region(SEXP x, R_xlen_t i, R_xlen_t n, int *buf) {
+    return lazy_region(x, i, n, buf);
+}
+
+static R_xlen_t lazy_raw_Get_region(SEXP x, R_xlen_t i, R_xlen_t n, Rbyte *buf) {
+    return lazy_region(x, i, n, buf);
+}
+
+static void lazy_methods(R_altrep_class_t cls) {
+    R_set_altrep_Length_method(cls, lazy_Length);
+    R_set_altrep_Inspect_method(cls, lazy_Inspect);
+    R_set_altvec_Dataptr_method(cls, lazy_Dataptr);
+    R_set_altvec_Dataptr_or_null_method(cls, lazy_Dataptr_or_null);
+}
+
+void init_lazy(DllInfo *dll) {
+    lazy_real = R_make_altreal_class("tiff_lazy_real", "tiff", dll);
+    lazy_methods(lazy_real);
+    R_set_altreal_Elt_method(lazy_real, lazy_real_Elt);
+    R_set_altreal_Get_region_method(lazy_real, lazy_real_Get_region);
+    lazy_int = R_make_altinteger_class("tiff_lazy_int", "tiff", dll);
+    lazy_methods(lazy_int);
+    R_set_altinteger_Elt_method(lazy_int, lazy_int_Elt);
+    R_set_altinteger_Get_region_method(lazy_int, lazy_int_Get_region);
+    lazy_raw = R_make_altraw_class("tiff_lazy_raw", "tiff", dll);
+    lazy_methods(lazy_raw);
+    R_set_altraw_Elt_method(lazy_raw, lazy_raw_Elt);
+    R_set_altraw_Get_region_method(lazy_raw, lazy_raw_Get_region);
+}
+
+typedef struct lazy_call {
+    SEXP sFn;
+    TIFF *tiff;
+    tiff_handle_t *h;
+    const decode_t *d;
+    SEXPTYPE type;
+    R_xlen_t len;
+    int threads;
+    lazy_t *z;
+} lazy_call_t;
+
+static SEXP lazy_body(void *data) {
+    lazy_call_t *a = (lazy_call_t*) data;
+    const decode_t *d = a->d;
+    SEXPTYPE type = a->type;
+    SEXP src = (TYPEOF(a->sFn) == EXTPTRSXP) ? R_ExternalPtrProtected(a->sFn) : a->sFn,
+	ptr = PROTECT(R_MakeExternalPtr(0, R_NilValue, src)), opt, res;
+    lazy_t *z = (lazy_t*) calloc(1, sizeof(lazy_t));
+    size_t i, n;
+
+    if (!z)
+	Rf_error("unable to allocate lazy image");
+    R_SetExternalPtrAddr(ptr, z);
+    R_RegisterCFinalizerEx(ptr, lazy_fin, TRUE);
+    a->z = z;
+    z->dec = *d;
+    z->type = type;
+    z->len = a->len;
+    z->esize = (type == REALSXP) ? sizeof(double) : ((type == INTSXP) ? sizeof(int) : 1);
+    z->threads = a->threads;
+    z->band = z->dec.ch * z->dec.group;
+    z->gx = (z->dec.x / z->dec.cw) * z->dec.cw;
+    z->gy = (z->dec.y / z->dec.ch) * z->dec.ch;
+    z->nx = (z->dec.x + z->dec.width - z->gx + z->dec.cw - 1) / z->dec.cw;
+    z->ny = (z->dec.y + z->dec.height - z->gy + z->band - 1) / z->band;
+    /* chunks are numbered with int */
+    n = (size_t) z->nx * z->ny;
+    if (n > INT_MAX)
+	Rf_error("image has too many strips or tiles for lazy=TRUE");
+    opt = GetOption1(install("tiff.lazy.cache"));
+    z->limit = (opt != R_NilValue && asReal(opt) >= 0) ? (size_t) asReal(opt) : LAZY_CACHE;
+
+    z->h.tiff = open_source(src, &z->h.rj);
+    TIFF_Keep(z->h.tiff);
+    z->h.rj.stats = 0; /* decodes on access are not part of the call */
+    z->h.first = TIFFCurrentDirOffset(a->tiff);
+    if (!TIFFSetSubDirectory(z->h.tiff, z->h.first))
+	Rf_error("unable to read the image");
+    /* the color map belongs to the directory of our handle */
+    if (z->dec.colormap[0])
+	TIFFGetField(z->h.tiff, TIFFTAG_COLORMAP, z->dec.colormap, z->dec.colormap + 1, z->dec.colormap + 2);
+    if (!(z->buf = _TIFFmalloc(z->dec.chunk_bytes * z->dec.group)) ||
+	!(z->slot_of = (int*) malloc(sizeof(int) * n)))
+	Rf_error("unable to allocate lazy image");
+    for (i = 0; i < n; i++)
+	z->slot_of[i] = -1;
+
+    res = R_new_altrep((type == REALSXP) ? lazy_real : ((type == INTSXP) ? lazy_int : lazy_raw), ptr, R_NilValue);
+    UNPROTECT(1);
+    return res;
+}
+
+/* on errors the lazy image's own TIFF is released right away (the
+   state itself goes with the finalizer) */
+static void lazy_cleanup(void *data, Rboolean jump) {
+    lazy_call_t *a = (lazy_call_t*) data;
+    if (!jump)
+	return;
+    if (a->z)
+	lazy_release(a->z);
+    if (!a->h)
+	TIFFClose(a->tiff);
+}
+
+/* create a lazy image for the current directory of tiff with the layout
+   and sample setup of d. The image gets its own handle on the source so
+   it stays valid when the source (or handle) is closed. Errors close
+   tiff unless it belongs to the handle h, like alloc_result(). */
+static SEXP lazy_image(SEXP sFn, TIFF *tiff, tiff_handle_t *h, const decode_t *d, SEXPTYPE type, R_xlen_t len, int threads) {
+    lazy_call_t a = { sFn, tiff, h, d, type, len, threads, 0 };
+    SEXP cont = PROTECT(R_MakeUnwindCont()), res;
+    res = R_UnwindProtect(lazy_body, &a, lazy_cleanup, &a, cont);
+    UNPROTECT(1);
+    return res;
+}
+#else
+void init_lazy(DllInfo *dll) { }
+#endif
+
+/* advance to the next image in the main chain. base is the offset of
+   the current image if one of its other levels may have been read */
+static int next_image(TIFF *tiff, toff_t base) {
+    if (base && TIFFCurrentDirOffset(tiff) != base)
+	TIFFSetSubDirectory(tiff, base);
+    return TIFFReadDirectory(tiff);
+}
+
+/* nanoseconds of the modification time where struct stat has them */
+#if defined(__APPLE__)
+#define ST_MTIME_NS(st) ((long) (st).st_mtimespec.tv_nsec)
+#elif defined(_WIN32)
+#define ST_MTIME_NS(st) 0L
+#else
+#define ST_MTIME_NS(st) ((long) (st).st_mtim.tv_nsec)
+#endif
+
+/* index of the image directories (IFDs) in the main chain of a file.
+   Indices of files are cached keyed by the file (device and inode),
+   its size, modification time and the offset of the first directory so
+   repeated reads of pages don't re-scan them. On Windows inodes are
+   not available, so files are not cached there. */
+typedef struct dir_index {
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    time_t mtime;
+    long mtime_ns;
+    int n;
+    int loop;      /* the chain loops, warned about on every use */
+    toff_t *dirs;
+} dir_index_t;
+
+#define DIR_CACHE 8
+
+static dir_index_t dir_cache[DIR_CACHE];
+static int dir_cache_next;
+
+/* read n bytes at offset off through the client procs of the handle */
+static int read_at(TIFF *tiff, toff_t off, void *buf, tmsize_t n, toff_t size) {
+    thandle_t h = TIFFClientdata(tiff);
+    if (off > size || size - off < (toff_t) n ||
+	TIFFGetSeekProc(tiff)(h, off, SEEK_SET) != off)
+	return 0;
+    return TIFFGetReadProc(tiff)(h, buf, n) == n;
+}
+
+/* offset of the first directory from the file header (0 if none) */
+static toff_t first_dir(TIFF *tiff, toff_t size) {
+    int big = TIFFIsBigTIFF(tiff), swap = TIFFIsByteSwapped(tiff);
+    uint32_t c32;
+    uint64_t c64;
+
+    if (!(big ? read_at(tiff, 8, &c64, 8, size) : read_at(tiff, 4, &c32, 4, size)))
+	return 0;
+    if (swap) big ? TIFFSwabLong8(&c64) : TIFFSwabLong(&c32);
+    return big ? c64 : c32;
+}
+
+/* set of directory offsets seen while following the chain, used to
+   detect loops like libtiff's _TIFFCheckDirNumberAndOffset(). Open
+   addressing with linear probing, 0 marks a free slot (it also ends
+   the chain so it is never added). */
+typedef struct off_set {
+    toff_t *slot;
+    size_t size, n; /* size is a power of two */
+} off_set_t;
+
+#define OFF_HASH(off, mask) ((size_t) (((uint64_t) (off) * 0x9E3779B97F4A7C15ull) >> 32) & (mask))
+
+/* add off to the set, returns 1 if it was added, 0 if it was already
+   there and -1 if out of memory */
+static int off_set_add(off_set_t *s, toff_t off) {
+    size_t i;
+    if (2 * (s->n + 1) > s->size) {
+	size_t size = s->size ? s->size * 2 : 256, j;
+	toff_t *slot = (toff_t*) calloc(size, sizeof(toff_t));
+	if (!slot)
+	    return -1;
+	for (j = 0; j < s->size; j++)
+	    if (s->slot[j]) {
+		for (i = OFF_HASH(s->slot[j], size - 1); slot[i]; i = (i + 1) & (size - 1)) {}
+		slot[i] = s->slot[j];
+	    }
+	free(s->slot);
+	s->slot = slot;
+	s->size = size;
+    }
+    for (i = OFF_HASH(off, s->size - 1); s->slot[i]; i = (i + 1) & (s->size - 1))
+	if (s->slot[i] == off)
+	    return 0;
+    s->slot[i] = off;
+    s->n++;
+    return 1;
+}
+
+static void dir_loop_warning(TIFF *tiff) {
+    TIFF_Warning(tiff, TIFFFileName(tiff), "directory loop detected, ignoring further directories");
+}
+
+/* collect the offsets of all directories by following the next-IFD
+   pointers only, without parsing the directories. The result is
+   allocated with malloc(), returns the number of directories. Problems
+   are reported to the TIFF (see TIFF_Errors()), so they are raised
+   once the caller releases it: a loop in the chain is a warning (and
+   sets *loop) and ends the index at the first repeated directory,
+   running out of memory is an error and leaves *dirs NULL. */
+static int scan_dirs(TIFF *tiff, toff_t **dirs, int *loop) {
+    int big = TIFFIsBigTIFF(tiff), swap = TIFFIsByteSwapped(tiff), n = 0, alloc = 0, seen = 1;
+    toff_t size = TIFFGetSizeProc(tiff)(TIFFClientdata(tiff)), off = first_dir(tiff, size);
+    off_set_t visited = { 0, 0, 0 };
+    uint16_t c16;
+    uint32_t c32;
+    uint64_t c64;
+
+    *dirs = 0;
+    while (off) {
+	uint64_t count;
+	if ((seen = off_set_add(&visited, off)) > 0 && n == alloc) {
+	    toff_t *nd = (toff_t*) realloc(*dirs, sizeof(toff_t) * (alloc = alloc ? alloc * 2 : 64));
+	    if (nd)
+		*dirs = nd;
+	    else
+		seen = -1;
+	}
+	if (seen < 0) {
+	    free(*dirs);
+	    *dirs = 0;
+	    n = 0;
+	}
+	if (seen <= 0)
+	    break;
+	(*dirs)[n++] = off;
+	if (big) {
+	    if (!read_at(tiff, off, &c64, 8, size)) break;
+	    if (swap) TIFFSwabLong8(&c64);
+	    count = c64;
+	    if (count > size || !read_at(tiff, off + 8 + count * 20, &c64, 8, size)) break;
+	    if (swap) TIFFSwabLong8(&c64);
+	    off = c64;
+	} else {
+	    if (!read_at(tiff, off, &c16, 2, size)) break;
+	    if (swap) TIFFSwabShort(&c16);
+	    count = c16;
+	    if (!read_at(tiff, off + 2 + count * 12, &c32, 4, size)) break;
+	    if (swap) TIFFSwabLong(&c32);
+	    off = c32;
+	}
+    }
+    free(visited.slot);
+    if (seen < 0)
+	TIFF_Error(tiff, TIFFFileName(tiff), "out of memory while indexing directories");
+    else if (!seen)
+	dir_loop_warning(tiff);
+    *loop = !seen;
+    return n;
+}
+
+/* stat() the open file of the job to key the cache, returns 0 if the
+   source can't be cached */
+static int dir_cache_key(const tiff_job_t *rj, struct stat *st) {
+#ifdef _WIN32
+    return 0;
+#else
+    return rj->f && !fstat(fileno(rj->f), st);
+#endif
+}
+
+/* return the directory index of the source, *n is set to the number of
+   directories. For in-memory sources the index is only valid until the
+   end of the .Call as it is allocated with R_alloc */
+static const toff_t *dir_index(TIFF *tiff, const tiff_job_t *rj, int *n) {
+    struct stat st;
+    dir_index_t *e;
+    toff_t *dirs;
+    int i, loop;
+
+    if (!dir_cache_key(rj, &st)) { /* no file to key the cache */
+	*n = scan_dirs(tiff, &dirs, &loop);
+	if (!dirs)
+	    return 0;
+	toff_t *res = (toff_t*) R_alloc(*n, sizeof(toff_t));
+	memcpy(res, dirs, sizeof(toff_t) * *n);
+	free(dirs);
+	return res;
+    }
+    for (i = 0; i < DIR_CACHE; i++) {
+	e = &dir_cache[i];
+	if (e->dirs && e->dev == st.st_dev && e->ino == st.st_ino && e->size == st.st_size &&
+	    e->mtime == st.st_mtime && e->mtime_ns == ST_MTIME_NS(st) &&
+	    e->dirs[0] == first_dir(tiff, (toff_t) st.st_size)) {
+	    *n = e->n;
+	    if (e->loop)
+		dir_loop_warning(tiff);
+	    return e->dirs;
+	}
+    }
+    *n = scan_dirs(tiff, &dirs, &loop);
+    if (!dirs || !*n) /* nothing to key on the first directory */
+	return dirs;
+    e = &dir_cache[dir_cache_next];
+    dir_cache_next = (dir_cache_next + 1) % DIR_CACHE;
+    free(e->dirs);
+    e->dev = st.st_dev;
+    e->ino = st.st_ino;
+    e->size = st.st_size;
+    e->mtime = st.st_mtime;
+    e->mtime_ns = ST_MTIME_NS(st);
+    e->n = *n;
+    e->loop = loop;
+    e->dirs = dirs;
+    return dirs;
+}
+
+/* directory index of the source, handles keep their own */
+static const toff_t *source_dirs(TIFF *tiff, const tiff_job_t *rj, tiff_handle_t *h, int *n) {
+    const toff_t *dirs;
+    int loop;
+    if (!h)
+	dirs = dir_index(tiff, rj, n);
+    else {
+	if (!h->dirs) /* a loop is reported once per handle */
+	    h->n_dirs = scan_dirs(tiff, &h->dirs, &loop);
+	*n = h->n_dirs;
+	dirs = h->dirs;
+    }
+    check_source(tiff, h); /* errors of scan_dirs() */
+    return dirs;
+}
+
+SEXP count_tiff(SEXP sFn) {
+    tiff_job_t rj;
+    tiff_handle_t *h;
+    TIFF *tiff = get_source(sFn, &rj, &h, 0);
+    int n = 0;
+    source_dirs(tiff, &rj, h, &n);
+    release_source(tiff, h);
+    return ScalarInteger(n);
+}
+
+/* advance the image iterator of a handle (nextTIFF), returns the 1-based
+   index of the next image or 0 if there are no more images. With skip
+   set reduced-resolution images are skipped as they are levels of the
+   preceding image. */
+SEXP next_tiff(SEXP sH, SEXP sSkip) {
+    tiff_job_t rj;
+    tiff_handle_t *h;
+    TIFF *tiff;
+    int skip = (asInteger(sSkip) == 1), n = 0;
+    const toff_t *dirs;
+
+    handle_of(sH); /* only handles keep the position, reject anything else before opening it */
+    tiff = get_source(sH, &rj, &h, 0);
+    dirs = source_dirs(tiff, &rj, h, &n);
+    while (h->next < n) {
+	int i = h->next++;
+	if (skip && i > 0) {
+	    if (TIFFCurrentDirOffset(tiff) != dirs[i] && !TIFFSetSubDirectory(tiff, dirs[i]))
+		continue;
+	    if (is_reduced(tiff))
+		continue;
+	}
+	check_source(tiff, h);
+	return ScalarInteger(i + 1);
+    }
+    check_source(tiff, h);
+    return ScalarInteger(0);
+}
+
+SEXP levels_tiff(SEXP sFn) {
+    tiff_job_t rj;
+    tiff_handle_t *h;
+    tiff_level_t lv[MAX_LEVELS];
+    TIFF *tiff = get_source(sFn, &rj, &h, 1);
+    int pass, total = 0;
+    SEXP res = R_NilValue, names;
+    int *page = 0, *level = 0, *width = 0, *length = 0, *tiled = 0, *subifd = 0;
+
+    /* first pass counts the levels, second fills the result */
+    for (pass = 0; pass < 2; pass++) {
+	int cur_dir = 1, i = 0;
+	if (pass) {
+	    res = PROTECT(allocVector(VECSXP, 6));
+	    page   = INTEGER(SET_VECTOR_ELT(res, 0, allocVector(INTSXP, total)));
+	    level  = INTEGER(SET_VECTOR_ELT(res, 1, allocVector(INTSXP, total)));
+	    width  = INTEGER(SET_VECTOR_ELT(res, 2, allocVector(INTSXP, total)));
+	    length = INTEGER(SET_VECTOR_ELT(res, 3, allocVector(INTSXP, total)));
+	    tiled  = LOGICAL(SET_VECTOR_ELT(res, 4, allocVector(LGLSXP, total)));
+	    subifd = INTEGER(SET_VECTOR_ELT(res, 5, allocVector(INTSXP, total)));
+	    TIFFSetDirectory(tiff, 0);
+	}
+	do {
+	    if (cur_dir == 1 || !is_reduced(tiff)) {
+		int n = collect_levels(tiff, cur_dir, lv), j;
+		if (pass)
+		    for (j = 0; j < n; j++, i++) {
+			page[i] = lv[j].page;
+			level[i] = j;
+			width[i] = lv[j].width;
+			length[i] = lv[j].length;
+			tiled[i] = lv[j].tiled;
+			subifd[i] = lv[j].subifd ? lv[j].subifd : NA_INTEGER;
+		    }
+		else
+		    total += n;
+	    }
+	    cur_dir++;
+	} while (TIFFReadDirectory(tiff));
+    }
+    release_source(tiff, h);
+
+    names = allocVector(STRSXP, 6);
+    setAttrib(res, R_NamesSymbol, names);
+    SET_STRING_ELT(names, 0, mkChar("page"));
+    SET_STRING_ELT(names, 1, mkChar("level"));
+    SET_STRING_ELT(names, 2, mkChar("width"));
+    SET_STRING_ELT(names, 3, mkChar("length"));
+    SET_STRING_ELT(names, 4, mkChar("tiled"));
+    SET_STRING_ELT(names, 5, mkChar("subifd"));
+    UNPROTECT(1);
+    return res;
+}
+
+/* metadata scanner (scanTIFF): one row per image in the main chain of
+   each file with the tags reported by TIFF_add_info() as columns.
+   Files are scanned by workers that must not call R, so values are
+   collected in plain C records first and the columns are filled once
+   the number of rows is known. */
+#define SC_INT   0 /* uint32 */
+#define SC_SHORT 1 /* uint16 */
+#define SC_REAL  2 /* float */
+#define SC_TEXT  3 /* ASCII */
+#define SC_NAME  4 /* uint16 reported by name */
+#define SC_BOOL  5 /* uint16 */
+#define SC_SUBS  6 /* number of SubIFDs */
+
+typedef const char *(*tag_name_t)(int v, char *uv, size_t len);
+
+typedef struct scan_col {
+    const char *name;
+    uint32_t tag;
+    int kind;
+    tag_name_t label; /* SC_NAME only */
+} scan_col_t;
+
+static const scan_col_t scan_cols[] = {
+    { "width", TIFFTAG_IMAGEWIDTH, SC_INT, 0 },
+    { "length", TIFFTAG_IMAGELENGTH, SC_INT, 0 },
+    { "depth", TIFFTAG_IMAGEDEPTH, SC_INT, 0 },
+    { "bits.per.sample", TIFFTAG_BITSPERSAMPLE, SC_SHORT, 0 },
+    { "samples.per.pixel", TIFFTAG_SAMPLESPERPIXEL, SC_SHORT, 0 },
+    { "sample.format", TIFFTAG_SAMPLEFORMAT, SC_NAME, sample_format_name },
+    { "planar.config", TIFFTAG_PLANARCONFIG, SC_NAME, planar_config_name },
+    { "subfile.type", TIFFTAG_SUBFILETYPE, SC_INT, 0 },
+    { "sub.ifds", TIFFTAG_SUBIFD, SC_SUBS, 0 },
+    { "rows.per.strip", TIFFTAG_ROWSPERSTRIP, SC_INT, 0 },
+    { "tile.width", TIFFTAG_TILEWIDTH, SC_INT, 0 },
+    { "tile.length", TIFFTAG_TILELENGTH, SC_INT, 0 },
+    { "compression", TIFFTAG_COMPRESSION, SC_NAME, compression_name },
+    { "threshholding", TIFFTAG_THRESHHOLDING, SC_SHORT, 0 },
+    { "x.resolution", TIFFTAG_XRESOLUTION, SC_REAL, 0 },
+    { "y.resolution", TIFFTAG_YRESOLUTION, SC_REAL, 0 },
+    { "x.position", TIFFTAG_XPOSITION, SC_REAL, 0 },
+    { "y.position", TIFFTAG_YPOSITION, SC_REAL, 0 },
+    { "resolution.unit", TIFFTAG_RESOLUTIONUNIT, SC_NAME, resolution_unit_name },
+#ifdef TIFFTAG_INDEXED
+    { "indexed", TIFFTAG_INDEXED, SC_BOOL, 0 },
+#endif
+    { "orientation", TIFFTAG_ORIENTATION, SC_NAME, orientation_name },
+    { "copyright", TIFFTAG_COPYRIGHT, SC_TEXT, 0 },
+    { "artist", TIFFTAG_ARTIST, SC_TEXT, 0 },
+    { "document.name", TIFFTAG_DOCUMENTNAME, SC_TEXT, 0 },
+    { "date.time", TIFFTAG_DATETIME, SC_TEXT, 0 },
+    { "description", TIFFTAG_IMAGEDESCRIPTION, SC_TEXT, 0 },
+    { "software", TIFFTAG_SOFTWARE, SC_TEXT, 0 },
+    { "color.space", TIFFTAG_PHOTOMETRIC, SC_NAME, color_space_name }
+};
+
+#define SCAN_COLS ((int) (sizeof(scan_cols) / sizeof(scan_cols[0])))
+
+/* a missing tag is NA (i), NA_REAL (d) or a NULL string (s) */
+typedef union scan_val {
+    int i;
+    double d;
+    char *s;
+} scan_val_t;
+
+typedef struct scan_file {
+    scan_val_t *vals; /* SCAN_COLS values per image (malloc()ed) */
+    int n, alloc;     /* number of images, allocated records */
+    char *err;        /* first error (malloc()ed) or NULL */
+} scan_file_t;
+
+static void scan_values(TIFF *tiff, scan_val_t *v) {
+    int j;
+    for (j = 0; j < SCAN_COLS; j++) {
+	const scan_col_t *col = scan_cols + j;
+	uint32_t i32;
+	uint16_t i16;
+	float f;
+	char *c = 0;
+	switch (col->kind) {
+	case SC_INT:
+	    v[j].i = TIFFGetField(tiff, col->tag, &i32) ? (int) i32 : NA_INTEGER;
+	    break;
+	case SC_SHORT:
+	case SC_NAME:
+	case SC_BOOL:
+	    v[j].i = TIFFGetField(tiff, col->tag, &i16) ? (int) i16 : NA_INTEGER;
+	    if (col->kind == SC_BOOL && v[j].i != NA_INTEGER)
+		v[j].i = (v[j].i != 0);
+	    break;
+	case SC_REAL:
+	    v[j].d = TIFFGetField(tiff, col->tag, &f) ? (double) f : NA_REAL;
+	    break;
+	case SC_TEXT:
+	    v[j].s = (TIFFGetField(tiff, col->tag, &c) && c) ? strdup(c) : 0;
+	    break;
+	case SC_SUBS:
+	    {
+		toff_t *sub = 0;
+		i16 = 0;
+		v[j].i = (TIFFGetField(tiff, col->tag, &i16, &sub) && i16) ? (int) i16 : NA_INTEGER;
+	    }
+	}
+    }
+}
+
+/* scan all images of a file, safe to call from worker threads */
+static void scan_file(const char *fn, scan_file_t *sf) {
+    tiff_job_t wj;
+    TIFF *tiff = 0;
+    char msg[512];
+
+    TIFF_Worker_Begin();
+    /* strip/tile offsets are not needed, so they are only loaded on
+       demand (ignored by libtiff before 4.1) */
+    if (fn && (tiff = TIFF_Worker_Open(fn, &wj, "rcO"))) {
+	do {
+	    if (sf->n == sf->alloc) {
+		int na = sf->alloc ? sf->alloc * 2 : 4;
+		scan_val_t *nv = (scan_val_t*) realloc(sf->vals, sizeof(scan_val_t) * SCAN_COLS * na);
+		if (!nv)
+		    break;
+		sf->vals = nv;
+		sf->alloc = na;
+	    }
+	    scan_values(tiff, sf->vals + (size_t) sf->n * SCAN_COLS);
+	    sf->n++;
+	} while (TIFFReadDirectory(tiff));
+	TIFFClose(tiff);
+    }
+    msg[0] = 0;
+    if (TIFF_Worker_End(msg, sizeof(msg)) || !tiff)
+	sf->err = strdup(msg[0] ? msg : (fn ? "unable to open TIFF" : "invalid file name"));
+}
+
+static void scan_free(scan_file_t *sf, int n) {
+    int i, j, k;
+    for (i = 0; i < n; i++) {
+	for (k = 0; k < sf[i].n; k++)
+	    for (j = 0; j < SCAN_COLS; j++)
+		if (scan_cols[j].kind == SC_TEXT)
+		    free(sf[i].vals[(size_t) k * SCAN_COLS + j].s);
+	free(sf[i].vals);
+	free(sf[i].err);
+    }
+}
+
+typedef struct scan_call {
+    SEXP files;
+    scan_file_t *sf;
+    int n;
+} scan_call_t;
+
+/* the data frame columns of the records of all files */
+static SEXP scan_columns(void *data) {
+    scan_call_t *a = (scan_call_t*) data;
+    scan_file_t *sf = a->sf;
+    int n = a->n, i, j, k;
+    R_xlen_t rows = 0, r;
+    SEXP res, names, cFile, cPage, cErr;
+
+    /* files without any readable image still get a row for the error */
+    for (i = 0; i < n; i++)
+	rows += sf[i].n ? sf[i].n : 1;
+
+    res = PROTECT(allocVector(VECSXP, SCAN_COLS + 3));
+    names = allocVector(STRSXP, SCAN_COLS + 3);
+    setAttrib(res, R_NamesSymbol, names);
+    cFile = SET_VECTOR_ELT(res, 0, allocVector(STRSXP, rows));
+    cPage = SET_VECTOR_ELT(res, 1, allocVector(INTSXP, rows));
+    cErr = SET_VECTOR_ELT(res, SCAN_COLS + 2, allocVector(STRSXP, rows));
+    SET_STRING_ELT(names, 0, mkChar("file"));
+    SET_STRING_ELT(names, 1, mkChar("page"));
+    SET_STRING_ELT(names, SCAN_COLS + 2, mkChar("error"));
+    for (j = 0; j < SCAN_COLS; j++) {
+	int kind = scan_cols[j].kind;
+	SET_VECTOR_ELT(res, j + 2, allocVector((kind == SC_REAL) ? REALSXP :
+					       (kind == SC_TEXT || kind == SC_NAME) ? STRSXP :
+					       (kind == SC_BOOL) ? LGLSXP : INTSXP, rows));
+	SET_STRING_ELT(names, j + 2, mkChar(scan_cols[j].name));
+    }
+
+    for (i = 0, r = 0; i < n; i++) {
+	SEXP err = sf[i].err ? mkChar(sf[i].err) : NA_STRING;
+	int m = sf[i].n ? sf[i].n : 1;
+	for (k = 0; k < m; k++, r++) {
+	    const scan_val_t *v = sf[i].n ? sf[i].vals + (size_t) k * SCAN_COLS : 0;
+	    SET_STRING_ELT(cFile, r, STRING_ELT(a->files, i));
+	    INTEGER(cPage)[r] = v ? k + 1 : NA_INTEGER;
+	    SET_STRING_ELT(cErr, r, err);
+	    for (j = 0; j < SCAN_COLS; j++) {
+		SEXP col = VECTOR_ELT(res, j + 2);
+		switch (scan_cols[j].kind) {
+		case SC_REAL:
+		    REAL(col)[r] = v ? v[j].d : NA_REAL;
+		    break;
+		case SC_TEXT:
+		    SET_STRING_ELT(col, r, (v && v[j].s) ? mkChar(v[j].s) : NA_STRING);
+		    break;
+		case SC_NAME:
+		    if (v && v[j].i != NA_INTEGER) {
+			char uv[24];
+			SET_STRING_ELT(col, r, mkChar(scan_cols[j].label(v[j].i, uv, sizeof(uv))));
+		    } else
+			SET_STRING_ELT(col, r, NA_STRING);
+		    break;
+		case SC_BOOL:
+		    LOGICAL(col)[r] = v ? v[j].i : NA_LOGICAL;
+		    break;
+		default:
+		    INTEGER(col)[r] = v ? v[j].i : NA_INTEGER;
+		}
+	    }
+	}
+    }
+    UNPROTECT(1);
+    return res;
+}
+
+static void scan_cleanup(void *data, Rboolean jump) {
+    scan_call_t *a = (scan_call_t*) data;
+    scan_free(a->sf, a->n);
+}
+
+SEXP scan_tiff(SEXP sFiles, SEXP sThreads) {
+    int n, i, threads = asInteger(sThreads);
+    const char **fn;
+    scan_file_t *sf;
+    scan_call_t a;
+    SEXP res;
+#if R_VERSION >= R_Version(3, 5, 0)
+    SEXP cont = PROTECT(R_MakeUnwindCont());
+#endif
+
+    if (TYPEOF(sFiles) != STRSXP)
+	Rf_error("invalid file names");
+    n = LENGTH(sFiles);
+    fn = (const char**) R_alloc(n, sizeof(const char*));
+    sf = (scan_file_t*) R_alloc(n, sizeof(scan_file_t));
+    memset(sf, 0, sizeof(scan_file_t) * n);
+    for (i = 0; i < n; i++)
+	fn[i] = (STRING_ELT(sFiles, i) == NA_STRING) ? 0 : CHAR(STRING_ELT(sFiles, i));
+    if (threads < 1 || threads == NA_INTEGER)
+	threads = 1;
+    TIFF_Init();
+
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(threads) schedule(dynamic) if (threads > 1)
+#endif
+    for (i = 0; i < n; i++)
+	scan_file(fn[i], sf + i);
+
+    /* the records are malloc()ed by the workers, so they are released
+       also when building the columns fails (R >= 3.5.0) */
+    a.files = sFiles;
+    a.sf = sf;
+    a.n = n;
+#if R_VERSION >= R_Version(3, 5, 0)
+    res = R_UnwindProtect(scan_columns, &a, scan_cleanup, &a, cont);
+    UNPROTECT(1);
+#else
+    res = scan_columns(&a);
+    scan_cleanup(&a, FALSE);
+#endif
+    return res;
+}
+
+/* statistics of timing=TRUE (set while read_tiff() runs, only used by
+   read_images() so a value left by an error is reset by the next call) */
+static tiff_stats_t read_stats, *read_timing;
+
+#if R_VERSION >= R_Version(3, 5, 0)
+typedef struct alloc_call {
+    SEXPTYPE type;
+    R_xlen_t n;
+    TIFF *tiff;
+    tiff_handle_t *h;
+} alloc_call_t;
+
+static SEXP alloc_body(void *data) {
+    alloc_call_t *a = (alloc_call_t*) data;
+    return allocVector(a->type, a->n);
+}
+
+/* the error of a failed allocation is passed on as it is, messages
+   libtiff collected so far are dropped with the TIFF */
+static void alloc_cleanup(void *data, Rboolean jump) {
+    alloc_call_t *a = (alloc_call_t*) data;
+    if (jump && !a->h)
+	TIFFClose(a->tiff);
+}
+#endif
+
+/* allocVector() of a result accounting for the time it takes. tiff is
+   open at this point and the allocation can fail with an
+   R error, so (in R >= 3.5.0) it runs under R_UnwindProtect() which
+   closes a TIFF not kept by a handle, releasing its file and mapping,
+   before the error continues. */
+static SEXP alloc_result(TIFF *tiff, tiff_handle_t *h, SEXPTYPE type, R_xlen_t n) {
+    double t0 = read_timing ? TIFF_Time() : 0;
+    SEXP res;
+#if R_VERSION >= R_Version(3, 5, 0)
+    alloc_call_t a = { type, n, tiff, h };
+    SEXP cont = PROTECT(R_MakeUnwindCont());
+    res = R_UnwindProtect(alloc_body, &a, alloc_cleanup, &a, cont);
+    UNPROTECT(1);
+#else
+    res = allocVector(type, n);
+#endif
+    if (read_timing)
+	read_timing->alloc += TIFF_Time() - t0;
+    return res;
+}
+
+/* with stack=TRUE all images are decoded into consecutive slices of one
+   array which is allocated with the first image */
+typedef struct img_stack {
+    SEXP res;
+    int n, i; /* number of slices, next slice */
+    uint32_t width, length;
+    uint16_t spp;
+} img_stack_t;
+
+/* returns the offset (in elements) of the slice for the next image,
+   s->res has to be protected by the caller with index ix */
+static R_xlen_t stack_next(TIFF *tiff, tiff_handle_t *h, img_stack_t *s, PROTECT_INDEX ix, SEXPTYPE type,
+			   uint32_t width, uint32_t length, uint16_t spp, int page) {
+    R_xlen_t size = (R_xlen_t) width * length * spp;
+    if (s->res == R_NilValue) {
+	REPROTECT(s->res = alloc_result(tiff, h, type, size * s->n), ix);
+	s->width = width;
+	s->length = length;
+	s->spp = spp;
+    } else if (TYPEOF(s->res) != type || s->width != width || s->length != length || s->spp != spp) {
+	release_source(tiff, h);
+	Rf_error("image %d differs from the first image in size, samples or type and cannot be stacked", page);
+    }
+    return size * s->i++;
+}
+
+/* checks that the array supplied in `out' can hold the image */
+static void check_out(TIFF *tiff, tiff_handle_t *h, SEXP out, SEXPTYPE type,
+		      uint32_t width, uint32_t length, uint16_t spp) {
+    SEXP dim = getAttrib(out, R_DimSymbol);
+    if (TYPEOF(out) != type) {
+	release_source(tiff, h);
+	Rf_error("`out' must be a%s %s array for this image", (type == INTSXP) ? "n" : "",
+		 (type == REALSXP) ? "double" : ((type == INTSXP) ? "integer" : "raw"));
+    }
+    if (XLENGTH(out) != (R_xlen_t) width * length * spp ||
+	(dim != R_NilValue && (LENGTH(dim) < 2 || LENGTH(dim) > 3 ||
+			       INTEGER(dim)[0] != length || INTEGER(dim)[1] != width))) {
+	release_source(tiff, h);
+	if (spp > 1)
+	    Rf_error("`out' must have the dimensions %u x %u x %d of the image",
+		     (unsigned int) length, (unsigned int) width, (int) spp);
+	Rf_error("`out' must have the dimensions %u x %u of the image",
+		 (unsigned int) length, (unsigned int) width);
+    }
+}
+
+/* number of images that are not reduced-resolution versions of the
+   preceding image, leaves the TIFF at the first image */
+static int count_full_images(TIFF *tiff, const toff_t *dirs, int n) {
+    int i, m = (n > 0) ? 1 : 0;
+    for (i = 1; i < n; i++)
+	if (TIFFSetSubDirectory(tiff, dirs[i]) && !is_reduced(tiff))
+	    m++;
+    if (n > 0)
+	TIFFSetSubDirectory(tiff, dirs[0]);
+    return m;
+}
+
+static SEXP read_images(SEXP sFn, SEXP sNative, SEXP sAll, SEXP sConvert, SEXP sInfo, SEXP sIndexed, SEXP sOriginal,
+			SEXP sPayload, SEXP sRegion, SEXP sLevel, SEXP sThreads, SEXP sOutput, SEXP sStack,
+			SEXP sLazy, SEXP sOut) {
     SEXP res = R_NilValue, multi_res = R_NilValue, multi_tail = R_NilValue, dim = R_NilValue;
-    const char *fn;
     int native = asInteger(sNative), all = (isLogical(sAll) && asInteger(sAll) > 0), n_img = 0,
 	convert = (asInteger(sConvert) == 1), add_info = (asInteger(sInfo) == 1),
 	indexed = (asInteger(sIndexed) == 1), original = (asInteger(sOriginal) == 1),
-	info_only = (asInteger(sPayload) == 0);
+	info_only = (asInteger(sPayload) == 0), threads = asInteger(sThreads),
+	output = asInteger(sOutput), stack = (asInteger(sStack) == 1),
+	lazy = (asInteger(sLazy) == 1);
     tiff_job_t rj;
+    tiff_handle_t *h;
     TIFF *tiff;
-    FILE *f;
     int *pick = (isInteger(sAll) ? INTEGER(sAll) : 0);
     int picks = pick ? LENGTH(sAll) : 0;
     SEXP pick_res = pick ? PROTECT(allocVector(VECSXP, picks)) : 0;
+    const int *region = 0, *level = 0;
+    img_stack_t stk;
+    PROTECT_INDEX stack_ix;
 
     /* make sure people don't use vector logicals - they must use which() if that's what they want */
     if (!((isLogical(sAll) && LENGTH(sAll) == 1) || isInteger(sAll)))
@@ -183,48 +2037,110 @@ SEXP read_tiff(SEXP sFn, SEXP sNative, SEXP sAll, SEXP sConvert, SEXP sInfo, SEX
 
     if (indexed && (convert || native))
 	Rf_error("indexed and native/convert cannot both be TRUE as they are mutually exclusive");
-    
-    if (TYPEOF(sFn) == RAWSXP) {
-	rj.data = (char*) RAW(sFn);
-	rj.len = LENGTH(sFn);
-	rj.alloc = rj.ptr = 0;
-	rj.f = f = 0;
-    } else {
-	if (TYPEOF(sFn) != STRSXP || LENGTH(sFn) < 1) Rf_error("invalid filename");
-	fn = CHAR(STRING_ELT(sFn, 0));
-	f = fopen(fn, "rb");
-	if (!f) Rf_error("unable to open %s", fn);
-	rj.f = f;
+
+    if (output != OUT_DOUBLE && output != OUT_INTEGER && output != OUT_RAW)
+	Rf_error("invalid output type");
+
+    if (stack && native)
+	Rf_error("stack=TRUE cannot be used with native=TRUE");
+
+    if (lazy && (native || convert || stack))
+	Rf_error("lazy=TRUE is only supported in direct mode and cannot be used with native, convert or stack");
+#ifndef HAVE_LAZY
+    if (lazy)
+	Rf_error("lazy=TRUE requires R 3.6.0 or higher");
+#endif
+
+    if (sOut != R_NilValue && !info_only &&
+	(native || convert || stack || lazy || all || picks > 1))
+	Rf_error("`out' can only be used to read a single image in direct mode");
+    /* `out' is written in place, so it must not be the data we decode
+       from nor an ALTREP vector whose data may not be writable */
+    if (sOut != R_NilValue && !info_only) {
+	if (sOut == ((TYPEOF(sFn) == EXTPTRSXP) ? R_ExternalPtrProtected(sFn) : sFn))
+	    Rf_error("`out' cannot be the raw vector the image is read from");
+#if R_VERSION >= R_Version(3, 5, 0)
+	if (ALTREP(sOut))
+	    Rf_error("`out' must be an ordinary array, not an ALTREP object");
+#endif
     }
 
-    tiff = TIFF_Open("rmc", &rj); /* no mmap, no chopping */
-    if (!tiff)
-	Rf_error("Unable to open TIFF");
+    /* only multiple images with a payload are stacked */
+    if ((!all && !pick) || info_only)
+	stack = 0;
+
+    /* as.is=TRUE keeps the integer values, so it takes precedence over
+       output="double" (which is scaled) */
+    if (original && output == OUT_DOUBLE)
+	output = OUT_INTEGER;
+
+    if (sRegion != R_NilValue) {
+	if (TYPEOF(sRegion) != INTSXP || LENGTH(sRegion) != 4)
+	    Rf_error("region must be an integer vector of the form c(x, y, width, height)");
+	region = INTEGER(sRegion);
+    }
+
+    if (sLevel != R_NilValue) {
+	if (TYPEOF(sLevel) != INTSXP || LENGTH(sLevel) != 2)
+	    Rf_error("invalid level specification");
+	level = INTEGER(sLevel);
+    }
+
+    tiff = get_source(sFn, &rj, &h, !pick);
 
     int cur_dir = 0; /* 1-based image number */
-    int nprot = 0;
+    int nprot = 0, next_pick = 0, n_dirs = 0;
+    const toff_t *dirs = 0;
+
+    /* If sAll is a numeric vector, only read images referenced in it,
+       in that order, by jumping to them using the directory index */
+    if (pick || stack)
+	dirs = source_dirs(tiff, &rj, h, &n_dirs);
+
+    memset(&stk, 0, sizeof(stk));
+    stk.res = R_NilValue;
+    if (stack) {
+	PROTECT_WITH_INDEX(stk.res, &stack_ix);
+	nprot++;
+	/* reduced-resolution images are not returned with a level */
+	stk.n = pick ? picks : (level ? count_full_images(tiff, dirs, n_dirs) : n_dirs);
+    }
+
     while (1) { /* loop over separate image in a directory if desired */
 	int pick_index = -1; /* not picked */
+	toff_t base = 0; /* offset of the image if a level is selected */
 	cur_dir++;
 
-	/* If sAll is a numeric vector, only read images referenced in it */
 	if (pick) {
-	    /* We don't use match() as it re-builds the hash table on every call. */
-	    int i = 0;
-	    while (i < picks) {
-		if (pick[i] == cur_dir) {
-		    pick_index = i;
-		    break;
+	    if (next_pick >= picks)
+		break;
+	    pick_index = next_pick++;
+	    cur_dir = pick[pick_index];
+	    /* pages that don't exist are left as NULL */
+	    if (cur_dir < 1 || cur_dir > n_dirs ||
+		(TIFFCurrentDirOffset(tiff) != dirs[cur_dir - 1] && !TIFFSetSubDirectory(tiff, dirs[cur_dir - 1]))) {
+		if (stack) {
+		    release_source(tiff, h);
+		    Rf_error("image %d does not exist and cannot be stacked", cur_dir);
 		}
-		i++;
+		continue;
 	    }
+	}
 
-	    if (pick_index == -1) { /* No match */
-		if (TIFFReadDirectory(tiff)) /* skip */
+	if (level) {
+	    /* reduced-resolution images are levels of the preceding image */
+	    if (cur_dir > 1 && is_reduced(tiff)) {
+		if (pick && stack) {
+		    release_source(tiff, h);
+		    Rf_error("image %d is a reduced-resolution image and cannot be stacked", cur_dir);
+		}
+		if (pick || TIFFReadDirectory(tiff))
 		    continue;
 		else
 		    break;
 	    }
+	    base = TIFFCurrentDirOffset(tiff);
+	    select_level(tiff, cur_dir, level[0], level[1]);
 	}
 
 
@@ -235,7 +2151,7 @@ SEXP read_tiff(SEXP sFn, SEXP sNative, SEXP sAll, SEXP sConvert, SEXP sInfo, SEX
 
 	    if (isLogical(sAll) && asInteger(sAll) == 0) {
 		UNPROTECT(1);
-		TIFFClose(tiff);
+		release_source(tiff, h);
 		return res;
 	    }
 	    n_img++;
@@ -253,19 +2169,19 @@ SEXP read_tiff(SEXP sFn, SEXP sNative, SEXP sAll, SEXP sConvert, SEXP sInfo, SEX
 		}
 	    }
 	    UNPROTECT(1);
-	    if (!TIFFReadDirectory(tiff))
+	    if (!pick && !next_image(tiff, base))
 		break;
 	    continue;
 	}
 
 	uint32_t imageWidth = 0, imageLength = 0, imageDepth;
 	uint32_t tileWidth, tileLength;
-	uint32_t x, y;
-	uint16_t config, bps = 8, spp = 1, sformat = 1, out_spp;
-	tdata_t buf;
+	uint32_t x, y, outX = 0, outY = 0, outWidth = 0, outLength = 0;
+	uint16_t config = PLANARCONFIG_CONTIG, bps = 8, spp = 1, sformat = 1, out_spp, photo;
 	double *ra = 0;
 	uint16_t *colormap[3] = {0, 0, 0};
-	int is_float = 0;
+	int is_float = 0, is_signed = 0;
+	decode_t dec;
 
 	TIFFGetField(tiff, TIFFTAG_IMAGEWIDTH, &imageWidth);
 	TIFFGetField(tiff, TIFFTAG_IMAGELENGTH, &imageLength);
@@ -279,7 +2195,10 @@ SEXP read_tiff(SEXP sFn, SEXP sNative, SEXP sAll, SEXP sConvert, SEXP sInfo, SEX
 	TIFFGetField(tiff, TIFFTAG_SAMPLESPERPIXEL, &spp);
 	out_spp = spp;
 	TIFFGetField(tiff, TIFFTAG_COLORMAP, colormap, colormap + 1, colormap + 2);
-	if (TIFFGetField(tiff, TIFFTAG_SAMPLEFORMAT, &sformat) && sformat == SAMPLEFORMAT_IEEEFP) is_float = 1;
+	if (TIFFGetField(tiff, TIFFTAG_SAMPLEFORMAT, &sformat)) {
+	    if (sformat == SAMPLEFORMAT_IEEEFP) is_float = 1;
+	    else if (sformat == SAMPLEFORMAT_INT) is_signed = 1;
+	}
 	if (spp == 1 && !indexed) { /* modify out_spp for colormaps */
 	    if (colormap[2]) out_spp = 3;
 	    else if (colormap[1]) out_spp = 2;
@@ -287,54 +2206,88 @@ SEXP read_tiff(SEXP sFn, SEXP sNative, SEXP sAll, SEXP sConvert, SEXP sInfo, SEX
 #ifdef TIFF_DEBUG
 	Rprintf("image %d x %d x %d, tiles %d x %d, bps = %d, spp = %d (output %d), config = %d, colormap = %s,\n",
 		imageWidth, imageLength, imageDepth, tileWidth, tileLength, bps, spp, out_spp, config, colormap[0] ? "yes" : "no");
-	Rprintf("      float = %d\n", is_float);
+	Rprintf("      float = %d, signed = %d\n", is_float, is_signed);
 #endif
+
+	if (!clip_region(region, imageWidth, imageLength, &outX, &outY, &outWidth, &outLength)) {
+	    release_source(tiff, h);
+	    Rf_error("region does not intersect the image (%u x %u) in image %d", imageWidth, imageLength, cur_dir);
+	}
 	
 	if (native || convert) {
 	    /* use built-in RGBA conversion - fortunately, libtiff uses exactly
 	       the same RGBA representation as R ... *but* flipped y coordinate :( */
 	    SEXP tmp = R_NilValue;
-	    /* FIXME: TIFF handle leak in case this fails */
-	    if (convert)
-		PROTECT(tmp = allocVector(REALSXP, imageWidth * imageLength * out_spp));
-	    res = PROTECT(allocVector(INTSXP, imageWidth * imageLength));
-	    TIFFReadRGBAImage(tiff, imageWidth, imageLength, (uint32_t*) INTEGER(res), 0);
-
-	    /* TIFF uses flipped y-axis, so we need to invert it .. argh ... */
-	    if (imageLength > 1) {
-		int *line = INTEGER(allocVector(INTSXP, imageWidth));
-		int *src = INTEGER(res), *dst = INTEGER(res) + imageWidth * (imageLength - 1), ls = imageWidth * sizeof(int);
-		int *el = src + imageWidth * (imageLength / 2);
-		while (src < el) {
-		    memcpy(line, src, ls);
-		    memcpy(src, dst,  ls);
-		    memcpy(dst, line, ls);
-		    src += imageWidth;
-		    dst -= imageWidth;
+	    R_xlen_t off = 0;
+	    if (convert && stack)
+		off = stack_next(tiff, h, &stk, stack_ix, REALSXP, outWidth, outLength, out_spp, cur_dir);
+	    else if (convert)
+		PROTECT(tmp = alloc_result(tiff, h, REALSXP, (R_xlen_t) outWidth * outLength * out_spp));
+	    res = PROTECT(alloc_result(tiff, h, INTSXP, (R_xlen_t) outWidth * outLength));
+	    memset(&dec, 0, sizeof(dec));
+	    if ((dec.native = native_layout(tiff))) {
+		/* common 8-bit layouts are packed directly from the strips or tiles */
+		dec.x = outX;
+		dec.y = outY;
+		dec.width = outWidth;
+		dec.height = outLength;
+		dec.bps = bps;
+		dec.out_spp = spp;
+		dec.ia = INTEGER(res);
+		decode_layout(tiff, &dec, spp, config);
+		decode_image(tiff, &rj, h, &dec, threads);
+	    } else {
+		if (!read_rgba(tiff, (uint32_t*) INTEGER(res), outX, outY, outWidth, outLength))
+		    check_source(tiff, h);
+
+		/* TIFF uses flipped y-axis, so we need to invert it .. argh ... */
+		if (outLength > 1) {
+		    int *line = INTEGER(allocVector(INTSXP, outWidth));
+		    int *src = INTEGER(res), *dst = INTEGER(res) + outWidth * (outLength - 1), ls = outWidth * sizeof(int);
+		    int *el = src + outWidth * (outLength / 2);
+		    while (src < el) {
+			memcpy(line, src, ls);
+			memcpy(src, dst,  ls);
+			memcpy(dst, line, ls);
+			src += outWidth;
+			dst -= outWidth;
+		    }
 		}
 	    }
+	    check_source(tiff, h);
 	    if (convert) {
 		uint16_t s;
-		uint32_t *data = (uint32_t*) INTEGER(res);
-		ra = REAL(tmp);
-		for (x = 0; x < imageWidth; x++)
-		    for (y = 0; y < imageLength; y++) {
-			if (out_spp == 1) { /* single plane (gray) just take R */
-			    ra[imageLength * x + y] = ((double)(data[x + y * imageWidth] & 255)) / 255.0;
-			} else if (out_spp == 2 /* G+A */) { /* this is a bit odd as we need to copy R and A */
-			    ra[imageLength * x + y] = ((double)(data[x + y * imageWidth] & 255)) / 255.0;
-			    ra[imageWidth * imageLength + imageLength * x + y] = ((double)((data[x + y * imageWidth] >> 16) & 255)) / 255.0;
-			} else /* 3-4 are simply sequential copies */
-			    for (s = 0; s < out_spp; s++)
-				ra[(imageLength * imageWidth * s) +
-				   imageLength * x + y] =
-				    ((double) ((data[x + y * imageWidth] >> (s * 8)) & 255)) / 255.0;
-		    }
+		uint32_t *data = (uint32_t*) INTEGER(res), yb, ye;
+		/* G+A uses R and A, 3-4 are simply sequential copies */
+		int shift[4] = { 0, (out_spp == 2) ? 24 : 8, 16, 24 };
+		R_xlen_t plane_size = (R_xlen_t) outWidth * outLength;
+		double t0 = read_timing ? TIFF_Time() : 0;
+		ra = stack ? REAL(stk.res) + off : REAL(tmp);
+		/* transpose in bands of rows so both sides stay in the cache */
+		for (yb = 0; yb < outLength; yb = ye) {
+		    ye = (outLength - yb > BAND_ROWS) ? yb + BAND_ROWS : outLength;
+		    for (s = 0; s < out_spp; s++)
+			for (x = 0; x < outWidth; x++) {
+			    const uint32_t *src = data + (R_xlen_t) yb * outWidth + x;
+			    double *dst = ra + plane_size * s + (R_xlen_t) outLength * x;
+			    for (y = yb; y < ye; y++, src += outWidth)
+				dst[y] = ((double) ((*src >> shift[s]) & 255)) / 255.0;
+			}
+		}
+		if (read_timing)
+		    read_timing->convert += TIFF_Time() - t0;
 		UNPROTECT(1); /* res */
+		if (stack) {
+		    if (add_info && stk.i == 1)
+			TIFF_add_info(tiff, stk.res);
+		    if (!pick && !next_image(tiff, base))
+			break;
+		    continue;
+		}
 		res = tmp;
 		dim = allocVector(INTSXP, (out_spp > 1) ? 3 : 2);
-		INTEGER(dim)[0] = imageLength;
-		INTEGER(dim)[1] = imageWidth;
+		INTEGER(dim)[0] = outLength;
+		INTEGER(dim)[1] = outWidth;
 		if (out_spp > 1)
 		    INTEGER(dim)[2] = out_spp;
 		setAttrib(res, R_DimSymbol, dim);
@@ -344,8 +2297,8 @@ SEXP read_tiff(SEXP sFn, SEXP sNative, SEXP sAll, SEXP sConvert, SEXP sInfo, SEX
 	    } else {
 		SEXP R_ChannelsSymbol = Rf_install("channels");
 		dim = allocVector(INTSXP, 2);
-		INTEGER(dim)[0] = imageLength;
-		INTEGER(dim)[1] = imageWidth;
+		INTEGER(dim)[0] = outLength;
+		INTEGER(dim)[1] = outWidth;
 		setAttrib(res, R_DimSymbol, dim);
 		setAttrib(res, R_ClassSymbol, mkString("nativeRaster"));
 		setAttrib(res, R_ChannelsSymbol, ScalarInteger(out_spp));
@@ -354,7 +2307,7 @@ SEXP read_tiff(SEXP sFn, SEXP sNative, SEXP sAll, SEXP sConvert, SEXP sInfo, SEX
 		UNPROTECT(1);
 	    }
 	    if (!all && !picks) {
-		TIFFClose(tiff);
+		release_source(tiff, h);
 		return res;
 	    }
 	    n_img++;
@@ -371,267 +2324,128 @@ SEXP read_tiff(SEXP sFn, SEXP sNative, SEXP sAll, SEXP sConvert, SEXP sInfo, SEX
 		    multi_tail = q;
 		}
 	    }
-	    if (!TIFFReadDirectory(tiff))
+	    if (!pick && !next_image(tiff, base))
 		break;
 	    continue;
 	} /* end native || convert */
 
-	if (bps != 8 && bps != 16 && bps != 32 && ( bps != 12 || spp != 1 )) {
-	    TIFFClose(tiff);
+	if (is_float ? (bps != 16 && bps != 32 && bps != 64) : ((bps < 1 || bps > 16) && bps != 32)) {
+	    release_source(tiff, h);
 	    Rf_error("image has %d bits/sample which is unsupported in direct mode - use native=TRUE or convert=TRUE", bps);
 	}
 
+	/* packed min-is-white images (e.g., bilevel scans) would come out
+	   inverted, samples of 8 bits and more are returned as stored */
+	if (bps < 8 && !original && TIFFGetField(tiff, TIFFTAG_PHOTOMETRIC, &photo) &&
+	    photo == PHOTOMETRIC_MINISWHITE) {
+	    release_source(tiff, h);
+	    Rf_error("min-is-white images with %d bits/sample are unsupported in direct mode - use as.is=TRUE for the stored values or native=TRUE or convert=TRUE", bps);
+	}
+
 	if (original && is_float) {
-	    TIFFClose(tiff);
+	    release_source(tiff, h);
 	    Rf_error("as.is=TRUE is not supported for floating point images");
 	}
 
-	if (sformat == SAMPLEFORMAT_INT && !original)
-	    Rf_warning("tiff package currently only supports unsigned integer or float sample formats in direct mode, but the image contains signed integer format - it will be treated as unsigned (use as.is=TRUE, native=TRUE or convert=TRUE depending on your intent)");
+	if (output != OUT_DOUBLE && is_float) {
+	    release_source(tiff, h);
+	    Rf_error("integer or raw output is not supported for floating point images");
+	}
 
-	/* FIXME: TIFF handle leak in case this fails */
-	res = allocVector((spp == 1 && (original || (indexed && colormap[0]))) ? INTSXP : REALSXP, imageWidth * imageLength * out_spp);
-	if (!(spp == 1 && (original || (indexed && colormap[0])))) ra = REAL(res);
-	
-#define DE12A(v) ((((unsigned int) v[0]) << 4) | (((unsigned int) v[1]) >> 4))
-#define DE12B(v) (((((unsigned int) v[1]) & 0x0f) << 8) | ((unsigned int) v[2]))
-
-	if (tileWidth == 0) {
-	    tstrip_t strip;
-	    tsize_t plane_offset = 0;
-	    x = 0; y = 0; 
-	    buf = _TIFFmalloc(TIFFStripSize(tiff));
-#ifdef TIFF_DEBUG
-	    Rprintf(" - %d x %d strips\n", TIFFNumberOfStrips(tiff), TIFFStripSize(tiff));
-#endif
-	    for (strip = 0; strip < TIFFNumberOfStrips(tiff); strip++) {
-		tsize_t n = TIFFReadEncodedStrip(tiff, strip, buf, (tsize_t) -1);
-		if (spp == 1) { /* config doesn't matter for spp == 1 */
-		    if (colormap[0] && !indexed) {
-			tsize_t i, step = bps / 8;
-			int *ia = original ? INTEGER(res) : 0;
-			if (bps == 12) step += 2;
-			for (i = 0; i < n; i += step) {
-			    unsigned int ci = 0, ci2 = 0;
-			    const unsigned char *v = (const unsigned char*) buf + i;
-			    if (bps == 8) ci = v[0];
-			    else if (bps == 16) ci = ((const unsigned short int*)v)[0];
-			    else if (bps == 32) ci = ((const unsigned int*)v)[0];
-			    else if (bps == 12) {
-				ci  = DE12A(v);
-				ci2 = DE12B(v);
-			    }
-			    if (original) {
-				ia[imageLength * x + y] = colormap[0][ci]; /* color maps are always 16-bit */
-				/* FIXME: bps==12 is broken with color map lookup !!! */
-				if (bps == 12)
-				    ia[imageLength * ++x + y] = colormap[0][ci2];
-				if (colormap[1]) {
-				    ia[(imageLength * imageWidth) + imageLength * x + y] = colormap[1][ci];
-				    if (colormap[2]) 
-					ia[(2 * imageLength * imageWidth) + imageLength * x + y] = colormap[2][ci];
-				}
-			    } else {
-				ra[imageLength * x + y] = ((double)colormap[0][ci]) / 65535.0; /* color maps are always 16-bit */
-				if (bps == 12)
-				    ra[imageLength * ++x + y] = ((double)colormap[0][ci2]) / 65535.0;
-				if (colormap[1]) {
-				    ra[(imageLength * imageWidth) + imageLength * x + y] = ((double)colormap[1][ci]) / 65535.0;
-				    if (colormap[2]) 
-					ra[(2 * imageLength * imageWidth) + imageLength * x + y] = ((double)colormap[2][ci]) / 65535.0;
-				}
-			    }
-			    x++;
-			    if (x >= imageWidth) {
-				x -= imageWidth;
-				y++;
-			    }
-			}
-		    } else if (colormap[0] || original) { /* indexed requested */
-			tsize_t i, step = bps / 8;
-			int *ia = INTEGER(res), ix_base = original ? 0 : 1;
-			if (bps == 12) step = 3;
-			for (i = 0; i < n; i += step) {
-			    int val = NA_INTEGER;
-			    const unsigned char *v = (const unsigned char*) buf + i;
-			    if (bps == 8) val = ix_base + v[0];
-			    else if (bps == 16) val = ix_base + ((const unsigned short int*)v)[0];
-			    else if (bps == 32) val = ix_base + ((const unsigned int*)v)[0];
-			    else if (bps == 12) {
-				ia[imageLength * x++ + y] = ix_base + DE12A(v);
-				val = ix_base + DE12B(v);
-			    }
-			    ia[imageLength * x++ + y] = val;
-			    if (x >= imageWidth) {
-				x -= imageWidth;
-				y++;
-			    }
-			}
-		    } else { /* direct gray */
-			tsize_t i, step = bps / 8;
-			if (bps == 12) step = 3;
-			for (i = 0; i < n; i += step) {
-			    double val = NA_REAL;
-			    const unsigned char *v = (const unsigned char*) buf + i;
-			    if (bps == 8) val = ((double) v[0]) / 255.0;
-			    else if (bps == 16) val = ((double) ((const unsigned short int*)v)[0]) / 65535.0;
-			    else if (bps == 32) {
-				if (is_float) val = (double) ((const float*)v)[0];
-				else val = ((double) ((const unsigned int*)v)[0]) / 4294967296.0;
-			    }
-			    if (bps == 12) {
-				ra[imageLength * x++ + y] = ((double) DE12A(v)) / 4096.0;
-				val = ((double) DE12B(v)) / 4096.0;
-			    }
-			    ra[imageLength * x + y] = val;
-			    x++;
-			    if (x >= imageWidth) {
-				x -= imageWidth;
-				y++;
-			    }
-			}
-		    }
-		} else if (config == PLANARCONFIG_CONTIG) { /* interlaced */
-		    tsize_t i, j, step = spp * bps / 8;
-		    for (i = 0; i < n; i += step) {
-			const unsigned char *v = (const unsigned char*) buf + i;
-			if (bps == 8) {
-			    for (j = 0; j < spp; j++)
-				ra[(imageLength * imageWidth * j) + imageLength * x + y] = ((double) v[j]) / 255.0;
-			} else if (bps == 16) {
-			    for (j = 0; j < spp; j++)
-				ra[(imageLength * imageWidth * j) + imageLength * x + y] = ((double) ((const unsigned short int*)v)[j]) / 65535.0;
-			} else if (bps == 32 && !is_float) {
-			    for (j = 0; j < spp; j++)
-				ra[(imageLength * imageWidth * j) + imageLength * x + y] = ((double) ((const unsigned int*)v)[j]) / 4294967296.0;
-			} else if (bps == 32 && is_float) {
-			    for (j = 0; j < spp; j++)
-				ra[(imageLength * imageWidth * j) + imageLength * x + y] = (double) ((const float*)v)[j];
-			}
-			x++;
-			if (x >= imageWidth) {
-			    x -= imageWidth;
-			    y++;
-			}
-		    }
-		} else { /* separate */
-		    tsize_t step = bps / 8, i;
-		    for (i = 0; i < n; i += step) {
-			const unsigned char *v = (const unsigned char*) buf + i;
-			if (bps == 8)
-			    ra[plane_offset + imageLength * x + y] = ((double) v[0]) / 255.0;
-			else if (bps == 16) 
-			    ra[plane_offset + imageLength * x + y] = ((double) ((const unsigned short int*)v)[0]) / 65535.0;
-			else if (bps == 32 && !is_float)
-			    ra[plane_offset + imageLength * x + y] = ((double) ((const unsigned int*)v)[0]) / 4294967296.0;
-			else if (bps == 32 && is_float)
-			    ra[plane_offset + imageLength * x + y] = (double) ((const float*)v)[0];
-		    }
-		    x++;
-		    if (x >= imageWidth) {
-			x -= imageWidth;
-			y++;
-			if (y >= imageLength) {
-			    y -= imageLength;
-			    plane_offset += imageWidth * imageLength;
-			}
-		    }
-		}
-	    }
-	} else { /* tiled image */
-	    if (indexed || colormap[0] || bps == 12)
-		Rf_error("Indexed and 12-bit tiled images are not supported.");
-	    
-	    if (spp > 1 && config != PLANARCONFIG_CONTIG)
-		Rf_error("Planar format tiled images are not supported");
+	if (output == OUT_RAW && (bps > 8 || is_signed || (indexed && colormap[0]))) {
+	    release_source(tiff, h);
+	    Rf_error("raw output is only supported for unsigned non-indexed images with at most 8 bits/sample");
+	}
 
-#ifdef TIFF_DEBUG
-	    Rprintf(" - %d x %d tiles\n", TIFFNumberOfTiles(tiff), TIFFTileSize(tiff));
+	SEXPTYPE rtype = (output == OUT_RAW) ? RAWSXP :
+	    ((output == OUT_INTEGER || (spp == 1 && indexed && colormap[0])) ? INTSXP : REALSXP);
+	R_xlen_t off = 0;
+	if (stack) {
+	    off = stack_next(tiff, h, &stk, stack_ix, rtype, outWidth, outLength, out_spp, cur_dir);
+	    res = stk.res;
+	} else if (sOut != R_NilValue) {
+	    check_out(tiff, h, sOut, rtype, outWidth, outLength, out_spp);
+	    res = sOut;
+	} else if (!lazy)
+	    res = alloc_result(tiff, h, rtype, (R_xlen_t) outWidth * outLength * out_spp);
+
+	memset(&dec, 0, sizeof(dec));
+	dec.x = outX;
+	dec.y = outY;
+	dec.width = outWidth;
+	dec.height = outLength;
+	dec.bps = bps;
+	dec.out_spp = out_spp;
+	dec.is_float = is_float;
+	dec.is_signed = is_signed;
+	/* packed integers are scaled to [0, 1] or [-1, 1) like 8/16 bits
+	   (12 bits have always been divided by 4096) */
+	if (bps <= 16)
+	    dec.scale = is_signed ? (double) (1u << (bps - 1)) :
+		((bps == 12) ? 4096.0 : (double) ((1u << bps) - 1));
+	dec.indexed = indexed;
+	/* indices are 1-based unless as.is=TRUE */
+	dec.ix_base = (indexed && spp == 1 && colormap[0] && !original) ? 1 : 0;
+	if (spp == 1) /* color maps only apply to single-sample images */
+	    memcpy(dec.colormap, colormap, sizeof(colormap));
+	dec.colors = (bps < 32) ? (1u << bps) : 0;
+	decode_layout(tiff, &dec, spp, config);
+#ifdef HAVE_LAZY
+	if (lazy)
+	    res = lazy_image(sFn, tiff, h, &dec, rtype, (R_xlen_t) outWidth * outLength * out_spp, threads);
+	else
 #endif
-	    x = 0; y = 0;
-	    buf = _TIFFmalloc(TIFFTileSize(tiff));
-
-	    for (y = 0; y < imageLength; y += tileLength)
-		for (x = 0; x < imageWidth; x += tileWidth) {
-		    tsize_t n = TIFFReadTile(tiff, buf, x, y, 0 /*depth*/, 0 /*plane*/);
-		    if (spp == 1) {
-			/* config doesn't matter for spp == 1 */
-			/* direct gray */
-			tsize_t i, step = bps / 8;
-			uint32_t xoff=0, yoff=0;
-			for (i = 0; i < n; i += step) {
-			    double val = NA_REAL;
-			    const unsigned char *v = (const unsigned char*) buf + i;
-			    if (bps == 8) val = ((double) v[0]) / 255.0;
-			    else if (bps == 16) val = ((double) ((const unsigned short int*)v)[0]) / 65535.0;
-			    else if (bps == 32) {
-				if (is_float) val = (double) ((const float*)v)[0];
-				else val = ((double) ((const unsigned int*)v)[0]) / 4294967296.0;
-			    }
-			    if (x + xoff < imageWidth && y + yoff < imageLength)
-				ra[imageLength * (x + xoff) + y + yoff] = val;
-			    xoff++;
-			    if (xoff >= tileWidth) {
-				xoff -= tileWidth;
-				yoff++;
-			    }
-			}
-		    } else if (config == PLANARCONFIG_CONTIG) { /* interlaced */
-			tsize_t i, j, step = spp * bps / 8;
-			uint32_t xoff=0, yoff=0;
-			for (i = 0; i < n; i += step) {
-			    const unsigned char *v = (const unsigned char*) buf + i;
-			    if (x + xoff < imageWidth && y + yoff < imageLength) {
-				if (bps == 8) {
-				    for (j = 0; j < spp; j++)
-					ra[(imageLength * imageWidth * j) + imageLength * (x + xoff) + y + yoff] = ((double) v[j]) / 255.0;
-				} else if (bps == 16) {
-				    for (j = 0; j < spp; j++)
-					ra[(imageLength * imageWidth * j) + imageLength * (x + xoff) + y + yoff] = ((double) ((const unsigned short int*)v)[j]) / 65535.0;
-				} else if (bps == 32 && !is_float) {
-				    for (j = 0; j < spp; j++)
-					ra[(imageLength * imageWidth * j) + imageLength * (x + xoff) + y + yoff] = ((double) ((const unsigned int*)v)[j]) / 4294967296.0;
-				} else if (bps == 32 && is_float) {
-				    for (j = 0; j < spp; j++)
-					ra[(imageLength * imageWidth * j) + imageLength * (x + xoff) + y + yoff] = (double) ((const float*)v)[j];
-				}
-			    }
-			    xoff++;
-			    if (xoff >= tileWidth) {
-				xoff -= tileWidth;
-				yoff++;
-			    }
-			} /* for i */
-		    } /* PLANARCONFIG_CONTIG */
-		} /* for x */
-	}
-
-	_TIFFfree(buf);
+	{
+	    if (TYPEOF(res) == INTSXP)
+		dec.ia = INTEGER(res) + off;
+	    else if (TYPEOF(res) == RAWSXP)
+		dec.rw = RAW(res) + off;
+	    else
+		dec.ra = REAL(res) + off;
+	    decode_image(tiff, &rj, h, &dec, threads);
+	    check_source(tiff, h);
+	}
 
+	/* stacks get the dimensions at the end and the attributes of the first image */
+	if (stack && stk.i > 1) {
+	    if (!pick && !next_image(tiff, base))
+		break;
+	    continue;
+	}
 	PROTECT(res);
-	dim = allocVector(INTSXP, (out_spp > 1) ? 3 : 2);
-	INTEGER(dim)[0] = imageLength;
-	INTEGER(dim)[1] = imageWidth;
-	if (out_spp > 1)
-	    INTEGER(dim)[2] = out_spp;
-	setAttrib(res, R_DimSymbol, dim);
-	if (colormap[0] && TYPEOF(res) == INTSXP && indexed) {
-	    int nc = 1 << bps, i;
-	    SEXP cm = allocMatrix(REALSXP, 3, nc);
-	    double *d = REAL(cm);
-	    for (i = 0; i < nc; i++) {
-		d[3 * i] = ((double) colormap[0][i]) / 65535.0;
-		d[3 * i + 1] = ((double) colormap[1][i]) / 65535.0;
-		d[3 * i + 2] = ((double) colormap[2][i]) / 65535.0;
+	/* `out' keeps its attributes, its dimensions have been checked already */
+	if (res != sOut) {
+	    if (!stack) {
+		dim = allocVector(INTSXP, (out_spp > 1) ? 3 : 2);
+		INTEGER(dim)[0] = outLength;
+		INTEGER(dim)[1] = outWidth;
+		if (out_spp > 1)
+		    INTEGER(dim)[2] = out_spp;
+		setAttrib(res, R_DimSymbol, dim);
+	    }
+	    if (colormap[0] && TYPEOF(res) == INTSXP && indexed) {
+		int nc = 1 << bps, i;
+		SEXP cm = allocMatrix(REALSXP, 3, nc);
+		double *d = REAL(cm);
+		for (i = 0; i < nc; i++) {
+		    d[3 * i] = ((double) colormap[0][i]) / 65535.0;
+		    d[3 * i + 1] = ((double) colormap[1][i]) / 65535.0;
+		    d[3 * i + 2] = ((double) colormap[2][i]) / 65535.0;
+		}
+		setAttr(res, "color.map", cm);
 	    }
-	    setAttr(res, "color.map", cm);
+	    if (add_info)
+		TIFF_add_info(tiff, res);
 	}
-	if (add_info)
-	    TIFF_add_info(tiff, res);
 	UNPROTECT(1);
-	
+	if (stack) {
+	    if (!pick && !next_image(tiff, base))
+		break;
+	    continue;
+	}
+
 	if (isLogical(sAll) && asInteger(sAll) == 0) {
-	    TIFFClose(tiff);
+	    release_source(tiff, h);
 	    return res;
 	}
 	n_img++;
@@ -648,10 +2462,29 @@ SEXP read_tiff(SEXP sFn, SEXP sNative, SEXP sAll, SEXP sConvert, SEXP sInfo, SEX
 		multi_tail = q;
 	    }
 	}
-	if (!TIFFReadDirectory(tiff))
+	if (!pick && !next_image(tiff, base))
 	    break;
     }
-    TIFFClose(tiff);
+    release_source(tiff, h);
+    if (stack && stk.res != R_NilValue) {
+	/* height x width [x samples] x images */
+	int nd = 0;
+	if (stk.i < stk.n) { /* the chain ended early */
+	    SEXP full = PROTECT(stk.res);
+	    REPROTECT(stk.res = xlengthgets(full, (R_xlen_t) stk.width * stk.length * stk.spp * stk.i), stack_ix);
+	    DUPLICATE_ATTRIB(stk.res, full);
+	    UNPROTECT(1);
+	}
+	dim = allocVector(INTSXP, (stk.spp > 1) ? 4 : 3);
+	INTEGER(dim)[nd++] = stk.length;
+	INTEGER(dim)[nd++] = stk.width;
+	if (stk.spp > 1)
+	    INTEGER(dim)[nd++] = stk.spp;
+	INTEGER(dim)[nd] = stk.i;
+	setAttrib(stk.res, R_DimSymbol, dim);
+	UNPROTECT(nprot + (pick ? 1 : 0));
+	return stk.res;
+    }
     /* if picked, we already have the result list */
     if (pick) {
 	UNPROTECT(nprot + 1 /* pick_res is the +1 */);
@@ -672,3 +2505,29 @@ SEXP read_tiff(SEXP sFn, SEXP sNative, SEXP sAll, SEXP sConvert, SEXP sInfo, SEX
     UNPROTECT(nprot);
     return res;
 }
+
+static SEXP read_body(void *data) {
+    SEXP *a = (SEXP*) data;
+    return read_images(a[0], a[1], a[2], a[3], a[4], a[5], a[6], a[7], a[8], a[9], a[10], a[11], a[12], a[13], a[14]);
+}
+
+SEXP read_tiff(SEXP sFn, SEXP sNative, SEXP sAll, SEXP sConvert, SEXP sInfo, SEXP sIndexed, SEXP sOriginal,
+	       SEXP sPayload, SEXP sRegion, SEXP sLevel, SEXP sThreads, SEXP sOutput, SEXP sStack,
+	       SEXP sLazy, SEXP sOut, SEXP sTiming) {
+    double t0 = TIFF_Time();
+    SEXP args[15] = { sFn, sNative, sAll, sConvert, sInfo, sIndexed, sOriginal, sPayload, sRegion, sLevel,
+		      sThreads, sOutput, sStack, sLazy, sOut }, res;
+    read_timing = (asInteger(sTiming) == 1) ? &read_stats : 0;
+    res = TIFF_Timed(read_timing, read_body, args);
+    /* `out' is not modified beyond its values, so the statistics are
+       returned instead */
+    if (read_timing && sOut != R_NilValue && asInteger(sPayload) != 0)
+	res = TIFF_Timing_Info(read_timing, TIFF_Time() - t0);
+    else if (read_timing && res != R_NilValue) {
+	PROTECT(res);
+	setAttrib(res, install("timing"), TIFF_Timing_Info(read_timing, TIFF_Time() - t0));
+	UNPROTECT(1);
+    }
+    read_timing = 0;
+    return res;
+}
@@ -4,13 +4,28 @@
 
 /* read.c */
 extern SEXP read_tiff(SEXP sFn, SEXP sNative, SEXP sAll, SEXP sConvert, SEXP sInfo, SEXP sIndexed,
-		      SEXP sOriginal, SEXP sPayload);
+		      SEXP sOriginal, SEXP sPayload, SEXP sRegion, SEXP sLevel, SEXP sThreads,
+		      SEXP sOutput, SEXP sStack, SEXP sLazy, SEXP sOut, SEXP sTiming);
+extern SEXP levels_tiff(SEXP sFn);
+extern SEXP count_tiff(SEXP sFn);
+extern SEXP open_tiff(SEXP sFn, SEXP sWrite);
+extern SEXP close_tiff(SEXP sH);
+extern SEXP next_tiff(SEXP sH, SEXP sSkip);
+extern SEXP scan_tiff(SEXP sFiles, SEXP sThreads);
+extern void init_lazy(DllInfo *dll);
 /* write.c */
-extern SEXP write_tiff(SEXP image, SEXP where, SEXP sBPS, SEXP sCompr, SEXP sReduce);
+extern SEXP write_tiff(SEXP image, SEXP where, SEXP sBPS, SEXP sCompr, SEXP sReduce, SEXP sRPS,
+		       SEXP sTile, SEXP sPyramid, SEXP sThreads, SEXP sTiming);
 
 static const R_CallMethodDef CAPI[] = {
-    {"read_tiff",  (DL_FUNC) &read_tiff , 8},
-    {"write_tiff", (DL_FUNC) &write_tiff, 5},
+    {"read_tiff",  (DL_FUNC) &read_tiff , 16},
+    {"levels_tiff", (DL_FUNC) &levels_tiff, 1},
+    {"count_tiff", (DL_FUNC) &count_tiff, 1},
+    {"open_tiff",  (DL_FUNC) &open_tiff, 2},
+    {"close_tiff", (DL_FUNC) &close_tiff, 1},
+    {"next_tiff",  (DL_FUNC) &next_tiff, 2},
+    {"scan_tiff",  (DL_FUNC) &scan_tiff, 2},
+    {"write_tiff", (DL_FUNC) &write_tiff, 10},
     {NULL, NULL, 0}
 };
 
@@ -18,4 +33,5 @@ void R_init_tiff(DllInfo *dll)
 {
     R_registerRoutines(dll, NULL, CAPI, NULL, NULL);
     R_useDynamicSymbols(dll, FALSE);
+    init_lazy(dll);
 }
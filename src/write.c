@@ -5,6 +5,10 @@
 
 #include "common.h"
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 #include <Rinternals.h>
 #include <Rversion.h>
 
@@ -26,15 +30,567 @@ int analyze_native(const unsigned int *what, int length) {
     return alpha | (ac << 1);
 }
 
-SEXP write_tiff(SEXP image, SEXP where, SEXP sBPS, SEXP sCompr, SEXP sReduce) {
-    SEXP dims, img_list = 0;
-    tiff_job_t rj;
+/* stop with the error libtiff reported for the output, if any,
+   closing tiff unless it is already closed (NULL). Warnings are only
+   raised once tiff is closed (they may turn into errors), until then
+   they stay in the job. */
+static void check_output(TIFF *tiff, tiff_job_t *rj) {
+    char msg[512];
+    if (tiff && !rj->errors)
+	return;
+    if (tiff)
+	TIFFClose(tiff);
+    if (TIFF_Errors(rj, msg, sizeof(msg)))
+	Rf_error("%s", msg);
+}
+
+/* statistics of timing=TRUE (set while write_tiff() runs, only used by
+   write_images() so a value left by an error is reset by the next call) */
+static tiff_stats_t write_stats, *write_timing;
+
+/* TIFFWriteEncodedStrip() or TIFFWriteEncodedTile() accounting for
+   the time spent compressing */
+static void write_chunk(TIFF *tiff, int tiled, uint32_t chunk, tdata_t buf, tsize_t size) {
+    double t0 = 0, io = 0;
+    if (write_timing) {
+	t0 = TIFF_Time();
+	io = write_timing->io;
+    }
+    if (tiled)
+	TIFFWriteEncodedTile(tiff, chunk, buf, size);
+    else
+	TIFFWriteEncodedStrip(tiff, chunk, buf, size);
+    if (write_timing) {
+	write_timing->codec += (TIFF_Time() - t0) - (write_timing->io - io);
+	write_timing->chunks++;
+    }
+}
+
+/* scratch buffer of size bytes, accounted for timing=TRUE */
+static tdata_t scratch_buffer(tsize_t size) {
+    if (write_timing && (double) size > write_timing->scratch)
+	write_timing->scratch = (double) size;
+    return _TIFFmalloc(size);
+}
+
+/* default size of a strip, a few strips have to be kept in memory by
+   readers accessing rows and large strips need large buffers to write */
+#define STRIP_BYTES (128 * 1024)
+
+/* rows per strip: rps if positive or about STRIP_BYTES for rows of
+   row_bytes bytes. JPEG needs a multiple of 8 unless it is one strip. */
+static uint32_t strip_rows(int rps, tsize_t row_bytes, uint32_t height, int compression) {
+    uint32_t rows = (rps > 0) ? (uint32_t) rps :
+	((row_bytes > 0 && row_bytes < STRIP_BYTES) ? (uint32_t) (STRIP_BYTES / row_bytes) : 1);
+    if (compression == COMPRESSION_JPEG && rows % 8)
+	rows += 8 - rows % 8;
+    return (rows > height) ? height : rows;
+}
+
+/* n pixels of a native image into G, GA or RGB samples */
+static void pack_native(const unsigned int *nd, unsigned char *data8, size_t n, int out_spp) {
+    size_t i;
+    int one = 1, little = ((const char*) &one)[0] == 1;
+    if (out_spp == 1)
+	for (i = 0; i < n; i++) /* G */
+	    data8[i] = nd[i] & 255;
+    else if (out_spp == 2) {
+	if (little)
+	    for (i = 0; i < n; i++) { /* GA */
+		*(data8++) = nd[i] & 255;
+		*(data8++) = (nd[i] >> 24) & 255;
+	    }
+	else /* big-endian */
+	    for (i = 0; i < n; i++) { /* GA */
+		*(data8++) = (nd[i] >> 24) & 255;
+		*(data8++) = nd[i] & 255;
+	    }
+    } else if (out_spp == 3) {
+	if (little)
+	    for (i = 0; i < n; i++) { /* RGB */
+		*(data8++) = nd[i] & 255;
+		*(data8++) = (nd[i] >> 8) & 255;
+		*(data8++) = (nd[i] >> 16) & 255;
+	    }
+	else /* big-endian */
+	    for (i = 0; i < n; i++) { /* RGB */
+		*(data8++) = (nd[i] >> 16) & 255;
+		*(data8++) = (nd[i] >> 8) & 255;
+		*(data8++) = nd[i] & 255;
+	    }
+    }
+}
+
+/* rows [y0, y0 + rows) of a real image (height x width x planes) into
+   contiguous bps-bit samples */
+static void pack_real(const double *ra, tdata_t buf, uint32_t width, uint32_t height, uint32_t planes,
+		      int bps, uint32_t y0, uint32_t rows) {
+    unsigned char *data8 = (unsigned char*) buf;
+    unsigned short *data16 = (unsigned short*) buf;
+    unsigned int *data32 = (unsigned int*) buf;
+    size_t plane_size = (size_t) width * height;
+    uint32_t x, y, pl;
+    if (bps == 8)
+	for (y = 0; y < rows; y++)
+	    for (x = 0; x < width; x++)
+		for (pl = 0; pl < planes; pl++)
+		    data8[((size_t) x + (size_t) y * width) * planes + pl] = (unsigned char) (ra[y0 + y + (size_t) x * height + pl * plane_size] * 255.0);
+    else if (bps == 16)
+	for (y = 0; y < rows; y++)
+	    for (x = 0; x < width; x++)
+		for (pl = 0; pl < planes; pl++)
+		    data16[((size_t) x + (size_t) y * width) * planes + pl] = (unsigned short) (ra[y0 + y + (size_t) x * height + pl * plane_size] * 65535.0);
+    else if (bps == 32)
+	for (y = 0; y < rows; y++)
+	    for (x = 0; x < width; x++)
+		for (pl = 0; pl < planes; pl++)
+		    data32[((size_t) x + (size_t) y * width) * planes + pl] = (unsigned int) (ra[y0 + y + (size_t) x * height + pl * plane_size] * 4294967295.0);
+}
+
+/* an image to write: contiguous samples of its rows are converted from
+   a real array (height x width x spp) or a native image, or taken as
+   they are from rows (native RGBA images and reduced levels) */
+typedef struct out_image {
+    uint32_t width, height;
+    int spp, bps;
+    const double *ra;
+    const unsigned int *nd;
+    const unsigned char *rows;
+} out_image_t;
+
+static tsize_t row_bytes(const out_image_t *im) {
+    return (tsize_t) im->width * im->spp * (im->bps / 8);
+}
+
+/* rows [y0, y0 + rows) of im: either directly from im->rows or
+   converted into buf */
+static const unsigned char *get_rows(const out_image_t *im, unsigned char *buf, uint32_t y0, uint32_t rows) {
+    double t0;
+    if (im->rows)
+	return im->rows + (size_t) y0 * row_bytes(im);
+    t0 = write_timing ? TIFF_Time() : 0;
+    if (im->nd)
+	pack_native(im->nd + (size_t) y0 * im->width, buf, (size_t) rows * im->width, im->spp);
+    else
+	pack_real(im->ra, buf, im->width, im->height, im->spp, im->bps, y0, rows);
+    if (write_timing)
+	write_timing->convert += TIFF_Time() - t0;
+    return buf;
+}
+
+/* reduced-resolution level (2x2 box filter) of a source image, built
+   from the rows of the source as they are written */
+typedef struct level {
+    out_image_t im;        /* the level, im.rows points to data */
+    unsigned char *data;   /* rows of the level */
+    unsigned char *carry;  /* even source row waiting for the next one */
+    uint32_t src_width, src_height, y; /* y = source rows added so far */
+} level_t;
+
+/* allocates the level of src, returns 0 on failure */
+static int init_level(level_t *lv, const out_image_t *src) {
+    lv->im = *src;
+    lv->im.width = (src->width + 1) / 2;
+    lv->im.height = (src->height + 1) / 2;
+    lv->im.ra = 0;
+    lv->im.nd = 0;
+    lv->src_width = src->width;
+    lv->src_height = src->height;
+    lv->y = 0;
+    lv->data = (unsigned char*) scratch_buffer(row_bytes(&lv->im) * lv->im.height);
+    lv->carry = (unsigned char*) scratch_buffer(row_bytes(src));
+    lv->im.rows = lv->data;
+    return lv->data && lv->carry;
+}
+
+static void free_level(level_t *lv) {
+    if (lv->data) _TIFFfree(lv->data);
+    if (lv->carry) _TIFFfree(lv->carry);
+    lv->data = lv->carry = 0;
+}
+
+/* average of 2x2 pixels of source rows a and b (the last column and
+   row are repeated for odd sizes) into a row of the level */
+#define REDUCE_ROW(T, S) {						\
+	const T *a = (const T*) a_, *b = (const T*) b_;			\
+	T *o = (T*) out;						\
+	for (x = 0; x < width; x += 2) {				\
+	    size_t p0 = (size_t) x * spp, p1 = (size_t) ((x + 1 < width) ? x + 1 : x) * spp; \
+	    for (s = 0; s < spp; s++)					\
+		*(o++) = (T) (((S) a[p0 + s] + a[p1 + s] + b[p0 + s] + b[p1 + s] + 2) / 4); \
+	} }
+
+static void reduce_row(const unsigned char *a_, const unsigned char *b_, unsigned char *out,
+		       uint32_t width, int spp, int bps) {
+    uint32_t x;
+    int s;
+    if (bps == 8)
+	REDUCE_ROW(unsigned char, unsigned int)
+    else if (bps == 16)
+	REDUCE_ROW(unsigned short, unsigned int)
+    else
+	REDUCE_ROW(unsigned int, uint64_t)
+}
+
+/* add n consecutive rows of the source to the level */
+static void level_rows(level_t *lv, const unsigned char *rows, uint32_t n) {
+    tsize_t lv_bytes = row_bytes(&lv->im), src_bytes = (tsize_t) lv->src_width * lv->im.spp * (lv->im.bps / 8);
+    double t0 = write_timing ? TIFF_Time() : 0;
+    uint32_t i = 0;
+    while (i < n) {
+	const unsigned char *a = rows + (size_t) i * src_bytes;
+	unsigned char *out = lv->data + (size_t) (lv->y / 2) * lv_bytes;
+	if (lv->y & 1) { /* pair of the carried row */
+	    reduce_row(lv->carry, a, out, lv->src_width, lv->im.spp, lv->im.bps);
+	    i++; lv->y++;
+	} else if (lv->y + 1 == lv->src_height) { /* last row of an odd height */
+	    reduce_row(a, a, out, lv->src_width, lv->im.spp, lv->im.bps);
+	    i++; lv->y++;
+	} else if (i + 1 < n) { /* both rows are here */
+	    reduce_row(a, a + src_bytes, out, lv->src_width, lv->im.spp, lv->im.bps);
+	    i += 2; lv->y += 2;
+	} else { /* the pair is in the next call */
+	    memcpy(lv->carry, a, src_bytes);
+	    i++; lv->y++;
+	}
+    }
+    if (write_timing)
+	write_timing->convert += TIFF_Time() - t0;
+}
+
+/* number of reduced levels of a width x height image: pyramid levels
+   or, for pyramid < 0, as many as it takes for the smallest one to fit
+   into size x size. Levels stop at 1 x 1. */
+static int pyramid_levels(uint32_t width, uint32_t height, int pyramid, uint32_t size) {
+    int n = 0;
+    while ((width > 1 || height > 1) &&
+	   ((pyramid < 0) ? (width > size || height > size) : (n < pyramid))) {
+	width = (width + 1) / 2;
+	height = (height + 1) / 2;
+	n++;
+    }
+    return n;
+}
+
+/* side of the smallest level of pyramid=TRUE when writing strips */
+#define PYRAMID_SIZE 256
+
+/* layout and encoding of the output */
+typedef struct out_layout {
+    int compression;
+    int rps;          /* rows per strip, 0 for about STRIP_BYTES */
+    uint32_t tile[2]; /* tile width and height, 0 for strips */
+    int threads;      /* threads compressing strips or tiles */
+} out_layout_t;
+
+/* sets the tags of im in the current directory, returns the number of
+   rows per strip or tile */
+static uint32_t set_tags(TIFF *tiff, const out_image_t *im, const out_layout_t *lay) {
+    uint32_t rps;
+    TIFFSetField(tiff, TIFFTAG_IMAGEWIDTH, im->width);
+    TIFFSetField(tiff, TIFFTAG_IMAGELENGTH, im->height);
+    TIFFSetField(tiff, TIFFTAG_PLANARCONFIG, 1);
+    TIFFSetField(tiff, TIFFTAG_SOFTWARE, "tiff package, R " R_MAJOR "." R_MINOR);
+    TIFFSetField(tiff, TIFFTAG_BITSPERSAMPLE, im->bps);
+    TIFFSetField(tiff, TIFFTAG_SAMPLESPERPIXEL, im->spp);
+    TIFFSetField(tiff, TIFFTAG_COMPRESSION, lay->compression);
+    TIFFSetField(tiff, TIFFTAG_PHOTOMETRIC, (im->spp > 2) ? PHOTOMETRIC_RGB : PHOTOMETRIC_MINISBLACK);
+    if (lay->tile[0]) {
+	TIFFSetField(tiff, TIFFTAG_TILEWIDTH, lay->tile[0]);
+	TIFFSetField(tiff, TIFFTAG_TILELENGTH, lay->tile[1]);
+	return lay->tile[1];
+    }
+    rps = strip_rows(lay->rps, row_bytes(im), im->height, lay->compression);
+    TIFFSetField(tiff, TIFFTAG_ROWSPERSTRIP, rps);
+    return rps;
+}
+
+/* the tile at column x of rows rows (of rb bytes) in band into tb of
+   tw x th pixels of px bytes, padded with zeros at the edges */
+static void copy_tile(unsigned char *tb, const unsigned char *band, tsize_t rb, tsize_t px,
+		      uint32_t x, uint32_t cols, uint32_t rows, uint32_t tw, uint32_t th) {
+    tsize_t tile_row = (tsize_t) tw * px;
+    uint32_t r;
+    if (rows < th || cols < tw)
+	memset(tb, 0, tile_row * th);
+    for (r = 0; r < rows; r++)
+	memcpy(tb + r * tile_row, band + r * rb + x * px, cols * px);
+}
+
+#ifdef _OPENMP
+/* a strip or tile compressed by a worker, held in its in-memory TIFF */
+typedef struct enc_chunk {
+    int worker; /* -1 if it failed */
+    toff_t off;
+    tsize_t size;
+} enc_chunk_t;
+
+/* strips or tiles per thread compressed in one batch */
+#define BATCH_CHUNKS 4
+
+/* write_data() with threads compressing the strips or tiles of a band
+   of rows concurrently, each into its own in-memory TIFF of the same
+   layout. The main thread then writes them in order with
+   TIFFWriteRawStrip()/TIFFWriteRawTile(), so the output is the same
+   as written by one thread. Returns 0 on failure with the message in err. */
+static int write_parallel(TIFF *tiff, const out_image_t *im, const out_layout_t *lay, uint32_t ch,
+			  level_t *lv, char *err, size_t err_len) {
+    int tiled = (lay->tile[0] != 0), threads = lay->threads, failed = 0, errors = 0;
+    uint32_t cw = tiled ? lay->tile[0] : im->width, nx = (im->width + cw - 1) / cw,
+	ny = (BATCH_CHUNKS * threads + nx - 1) / nx, band_rows;
+    tsize_t rb = row_bytes(im), px = rb / im->width, tile_size = (tsize_t) cw * ch * px;
+    unsigned char *band = 0;
+    enc_chunk_t *enc;
+    tiff_job_t *wjs;
+    tiff_stats_t *st = write_timing;
+
+    if (ny > (im->height + ch - 1) / ch)
+	ny = (im->height + ch - 1) / ch;
+    band_rows = ny * ch;
+    enc = (enc_chunk_t*) calloc((size_t) nx * ny, sizeof(enc_chunk_t));
+    wjs = (tiff_job_t*) calloc(threads, sizeof(tiff_job_t));
+    if (!enc || !wjs || (!im->rows && !(band = (unsigned char*) scratch_buffer(rb * band_rows)))) {
+	free(enc);
+	free(wjs);
+	snprintf(err, err_len, "cannot allocate output buffer");
+	return 0;
+    }
+
+#pragma omp parallel num_threads(threads)
+    {
+	int me = omp_get_thread_num();
+	tiff_job_t *wj = &wjs[me];
+	tiff_stats_t ws; /* merged into st at the end */
+	TIFF *wt;
+	unsigned char *tb = 0;
+	long start = 0;
+	uint32_t y0;
+	char msg[512];
+
+	memset(&ws, 0, sizeof(ws));
+	TIFF_Worker_Begin();
+	if ((wt = TIFF_Worker_Create(wj))) {
+	    set_tags(wt, im, lay);
+	    start = wj->len;
+	    if (tiled)
+		tb = (unsigned char*) _TIFFmalloc(tile_size);
+	}
+	for (y0 = 0; y0 < im->height && !failed; y0 += band_rows) {
+	    uint32_t rows = (im->height - y0 < band_rows) ? im->height - y0 : band_rows,
+		n_rows = (rows + ch - 1) / ch;
+	    const unsigned char *data = im->rows ? im->rows + (size_t) y0 * rb : band;
+	    int j, k;
+	    if (wt) /* the chunks of the last band have been written */
+		wj->len = wj->ptr = start;
+	    if (!im->rows) {
+#pragma omp for schedule(dynamic)
+		for (j = 0; j < (int) n_rows; j++) {
+		    uint32_t y = y0 + j * ch, r = (im->height - y < ch) ? im->height - y : ch;
+		    double t0 = st ? TIFF_Time() : 0;
+		    if (im->nd)
+			pack_native(im->nd + (size_t) y * im->width, band + (size_t) j * ch * rb,
+				    (size_t) r * im->width, im->spp);
+		    else
+			pack_real(im->ra, band + (size_t) j * ch * rb, im->width, im->height, im->spp, im->bps, y, r);
+		    if (st)
+			ws.convert += TIFF_Time() - t0;
+		}
+	    }
+#pragma omp for schedule(dynamic)
+	    for (k = 0; k < (int) (n_rows * nx); k++) {
+		uint32_t y = y0 + (k / nx) * ch, x = (k % nx) * cw, chunk,
+		    r = (im->height - y < ch) ? im->height - y : ch;
+		const unsigned char *src = data + (size_t) (y - y0) * rb;
+		toff_t *offs, *counts;
+		tsize_t n;
+		double t0 = st ? TIFF_Time() : 0;
+		enc[k].worker = -1;
+		if (!wt || (tiled && !tb))
+		    continue;
+		if (tiled) {
+		    copy_tile(tb, src, rb, px, x, (im->width - x < cw) ? im->width - x : cw, r, cw, ch);
+		    if (st) {
+			double t1 = TIFF_Time();
+			ws.convert += t1 - t0;
+			t0 = t1;
+		    }
+		    chunk = TIFFComputeTile(wt, x, y, 0, 0);
+		    n = TIFFWriteEncodedTile(wt, chunk, tb, tile_size);
+		} else {
+		    chunk = TIFFComputeStrip(wt, y, 0);
+		    n = TIFFWriteEncodedStrip(wt, chunk, (tdata_t) src, rb * r);
+		}
+		if (n >= 0 && TIFFGetField(wt, TIFFTAG_STRIPOFFSETS, &offs) &&
+		    TIFFGetField(wt, TIFFTAG_STRIPBYTECOUNTS, &counts)) {
+		    enc[k].worker = me;
+		    enc[k].off = offs[chunk];
+		    enc[k].size = (tsize_t) counts[chunk];
+		}
+		if (st) {
+		    ws.codec += TIFF_Time() - t0;
+		    ws.chunks++;
+		}
+	    }
+#pragma omp master
+	    {
+		for (k = 0; k < (int) (n_rows * nx) && !failed; k++) {
+		    uint32_t y = y0 + (k / nx) * ch, x = (k % nx) * cw;
+		    tdata_t buf;
+		    if (enc[k].worker < 0) {
+			failed = 1;
+			break;
+		    }
+		    buf = (tdata_t) (wjs[enc[k].worker].data + enc[k].off);
+		    if ((tiled ? TIFFWriteRawTile(tiff, TIFFComputeTile(tiff, x, y, 0, 0), buf, enc[k].size) :
+			 TIFFWriteRawStrip(tiff, TIFFComputeStrip(tiff, y, 0), buf, enc[k].size)) < 0)
+			failed = 1;
+		}
+		if (lv && !failed)
+		    level_rows(lv, data, rows);
+	    }
+#pragma omp barrier
+	}
+	if (tb)
+	    _TIFFfree(tb);
+	if (wt)
+	    TIFFClose(wt);
+	if (st) {
+#pragma omp critical
+	    TIFF_Stats_Add(st, &ws);
+	}
+	msg[0] = 0;
+	if (TIFF_Worker_End(msg, sizeof(msg)) || !wt || (tiled && !tb)) {
+#pragma omp critical
+	    if (!errors++)
+		snprintf(err, err_len, "%s", msg[0] ? msg : "unable to set up a compression thread");
+	}
+    }
+    if (band)
+	_TIFFfree(band);
+    free(enc);
+    free(wjs);
+    if (failed && !errors)
+	snprintf(err, err_len, "failed to write compressed data");
+    return !(failed || errors);
+}
+#endif
+
+/* sets the tags of im in the current directory and writes its data in
+   strips or tiles (see out_layout_t), passing the rows on to the level
+   lv (if not NULL). Returns 0 on failure with the message in err. */
+static int write_data(TIFF *tiff, const out_image_t *im, const out_layout_t *lay, level_t *lv,
+		      char *err, size_t err_len) {
+    tsize_t rb = row_bytes(im);
+    unsigned char *buf = 0;
+    uint32_t y, ch = set_tags(tiff, im, lay);
+#ifdef _OPENMP
+    /* JPEG shares tables between the chunks and is left serial */
+    if (lay->threads > 1 && lay->compression != COMPRESSION_NONE && lay->compression != COMPRESSION_JPEG &&
+	(lay->tile[0] ? (im->width > lay->tile[0] || im->height > ch) : (im->height > ch))) {
+	out_layout_t par = *lay;
+	uint32_t n = (lay->tile[0] ? (im->width + lay->tile[0] - 1) / lay->tile[0] : 1) * ((im->height + ch - 1) / ch);
+	if ((uint32_t) par.threads > n)
+	    par.threads = (int) n;
+	return write_parallel(tiff, im, &par, ch, lv, err, err_len);
+    }
+#endif
+    if (lay->tile[0]) { /* a row of tiles at a time, copied tile by tile */
+	uint32_t tw = lay->tile[0], th = ch, x;
+	tsize_t px = rb / im->width, tile_size = (tsize_t) tw * th * px;
+	unsigned char *tb;
+	if ((!im->rows && !(buf = (unsigned char*) scratch_buffer(rb * th))) ||
+	    !(tb = (unsigned char*) scratch_buffer(tile_size))) {
+	    if (buf) _TIFFfree(buf);
+	    snprintf(err, err_len, "cannot allocate output buffer");
+	    return 0;
+	}
+	for (y = 0; y < im->height; y += th) {
+	    uint32_t rows = (im->height - y < th) ? im->height - y : th;
+	    const unsigned char *band = get_rows(im, buf, y, rows);
+	    for (x = 0; x < im->width; x += tw) {
+		double t0 = write_timing ? TIFF_Time() : 0;
+		copy_tile(tb, band, rb, px, x, (im->width - x < tw) ? im->width - x : tw, rows, tw, th);
+		if (write_timing)
+		    write_timing->convert += TIFF_Time() - t0;
+		write_chunk(tiff, 1, TIFFComputeTile(tiff, x, y, 0, 0), tb, tile_size);
+	    }
+	    if (lv)
+		level_rows(lv, band, rows);
+	}
+	_TIFFfree(tb);
+    } else {
+	uint32_t strip;
+	if (!im->rows && !(buf = (unsigned char*) scratch_buffer(rb * ch))) {
+	    snprintf(err, err_len, "cannot allocate output buffer");
+	    return 0;
+	}
+	for (y = 0, strip = 0; y < im->height; y += ch, strip++) {
+	    uint32_t rows = (im->height - y < ch) ? im->height - y : ch;
+	    const unsigned char *data = get_rows(im, buf, y, rows);
+	    write_chunk(tiff, 0, strip, (tdata_t) data, rb * rows);
+	    if (lv)
+		level_rows(lv, data, rows);
+	}
+    }
+    if (buf)
+	_TIFFfree(buf);
+    return 1;
+}
+
+/* writes im into the current directory followed by pyramid reduced
+   levels (see pyramid_levels()) as its SubIFDs. Each level is computed
+   from the rows of the one above while that is written, so only two
+   levels are held in memory. Returns 0 on failure with the message in err. */
+static int write_image(TIFF *tiff, const out_image_t *im, const out_layout_t *lay, int pyramid,
+		       char *err, size_t err_len) {
+    level_t lv[2];
+    int n = 0, i, ok;
+    memset(lv, 0, sizeof(lv));
+    if (pyramid) {
+	toff_t sub_ifds[32];
+	n = pyramid_levels(im->width, im->height, pyramid,
+			   lay->tile[0] ? ((lay->tile[0] > lay->tile[1]) ? lay->tile[0] : lay->tile[1]) : PYRAMID_SIZE);
+	if (n) {
+	    memset(sub_ifds, 0, sizeof(sub_ifds));
+	    TIFFSetField(tiff, TIFFTAG_SUBIFD, (uint16_t) n, sub_ifds);
+	    if (!init_level(&lv[0], im)) {
+		free_level(&lv[0]);
+		snprintf(err, err_len, "cannot allocate output buffer");
+		return 0;
+	    }
+	}
+    }
+    ok = write_data(tiff, im, lay, n ? &lv[0] : 0, err, err_len);
+    for (i = 0; ok && i < n; i++) {
+	level_t *cur = &lv[i & 1], *next = (i + 1 < n) ? &lv[(i + 1) & 1] : 0;
+	if (next && !init_level(next, &cur->im)) {
+	    snprintf(err, err_len, "cannot allocate output buffer");
+	    ok = 0;
+	    break;
+	}
+	TIFFWriteDirectory(tiff);
+	TIFFSetField(tiff, TIFFTAG_SUBFILETYPE, FILETYPE_REDUCEDIMAGE);
+	ok = write_data(tiff, &cur->im, lay, next, err, err_len);
+	free_level(cur);
+    }
+    free_level(&lv[0]);
+    free_level(&lv[1]);
+    return ok;
+}
+
+static SEXP write_images(SEXP image, SEXP where, SEXP sBPS, SEXP sCompr, SEXP sReduce, SEXP sRPS,
+			 SEXP sTile, SEXP sPyramid, SEXP sThreads) {
+    SEXP dims, img_list = 0, res;
+    tiff_job_t rj, *job = &rj;
+    tiff_handle_t *h = 0;
     TIFF *tiff;
     FILE *f;
-    int native = 0, raw_array = 0, bps = asInteger(sBPS), compression = asInteger(sCompr),
-	reduce = asInteger(sReduce),
-	img_index = 0, n_img = 1;
+    int native = 0, raw_array = 0, out_of_range = 0, bps = asInteger(sBPS), reduce = asInteger(sReduce),
+	pyramid = asInteger(sPyramid), img_index = 0, n_img = 1;
     uint32_t width, height, planes = 1;
+    out_image_t im;
+    out_layout_t lay;
+    char err[512];
 
     if (TYPEOF(image) == VECSXP) {
 	if ((n_img = LENGTH(image)) == 0) {
@@ -47,7 +603,32 @@ SEXP write_tiff(SEXP image, SEXP where, SEXP sBPS, SEXP sCompr, SEXP sReduce) {
     if (bps != 8 && bps != 16 && bps != 32)
 	Rf_error("currently bits.per.sample must be 8, 16 or 32");
 
-    if (TYPEOF(where) == RAWSXP) {
+    lay.compression = asInteger(sCompr);
+    lay.rps = asInteger(sRPS);
+    lay.tile[0] = lay.tile[1] = 0;
+    if (TYPEOF(sTile) == INTSXP && LENGTH(sTile) == 2) { /* tile width, height (checked by writeTIFF) */
+	lay.tile[0] = INTEGER(sTile)[0];
+	lay.tile[1] = INTEGER(sTile)[1];
+    }
+    lay.threads = asInteger(sThreads);
+    if (lay.threads < 1 || lay.threads == NA_INTEGER)
+	lay.threads = 1;
+    if (pyramid == NA_INTEGER)
+	pyramid = 0;
+
+    if (TYPEOF(where) == EXTPTRSXP) { /* handle of openTIFF(..., "w") */
+	if (!inherits(where, "TIFFhandle"))
+	    Rf_error("invalid TIFF handle");
+	if (!(h = (tiff_handle_t*) R_ExternalPtrAddr(where)) || !h->tiff)
+	    Rf_error("TIFF handle is closed");
+	if (!h->writing)
+	    Rf_error("TIFF handle is not open for writing");
+	if (h->failed)
+	    Rf_error("writing to the TIFF handle failed before, close it with closeTIFF()");
+	job = &h->rj;
+	TIFF_Timing_Job(job);
+	tiff = h->tiff;
+    } else if (TYPEOF(where) == RAWSXP) {
 	rj.alloc = INIT_SIZE;
 	if (!(rj.data = malloc(rj.alloc)))
 	    Rf_error("unable to allocate memory for the in-memory output buffer");
@@ -61,12 +642,17 @@ SEXP write_tiff(SEXP image, SEXP where, SEXP sBPS, SEXP sCompr, SEXP sReduce) {
 	f = fopen(fn, "w+b");
 	if (!f) Rf_error("unable to create %s", fn);
 	rj.f = f;
+	rj.fn = fn;
     }
 
-    tiff = TIFF_Open("wm", &rj);
-    if (!tiff) {
-	if (!rj.f)
+    if (!h && !(tiff = TIFF_Open("wm", &rj))) {
+	char msg[512];
+	if (rj.f)
+	    fclose(rj.f);
+	else
 	    free(rj.data);
+	if (TIFF_Errors(&rj, msg, sizeof(msg)))
+	    Rf_error("%s", msg);
 	Rf_error("cannot create TIFF structure");
     }
 
@@ -116,125 +702,107 @@ SEXP write_tiff(SEXP image, SEXP where, SEXP sBPS, SEXP sCompr, SEXP sReduce) {
 	    native = 1; /* from now on we treat raw arrays like native */
 	}
 	
-	TIFFSetField(tiff, TIFFTAG_IMAGEWIDTH, width);
-	TIFFSetField(tiff, TIFFTAG_IMAGELENGTH, height);
-	TIFFSetField(tiff, TIFFTAG_PLANARCONFIG, 1);
-	TIFFSetField(tiff, TIFFTAG_SOFTWARE, "tiff package, R " R_MAJOR "." R_MINOR);
+	im.width = width;
+	im.height = height;
+	im.ra = 0;
+	im.nd = 0;
+	im.rows = 0;
 	if (native) {
-	    TIFFSetField(tiff, TIFFTAG_BITSPERSAMPLE, 8);
+	    const unsigned int *nd = (const unsigned int*) INTEGER(image);
+	    double t0 = write_timing ? TIFF_Time() : 0;
+	    im.bps = 8;
+	    im.spp = 4;
 	    if (reduce) {
-		int an = analyze_native((const unsigned int*) INTEGER(image), width * height);
-		if (an == (HAS_ALPHA | IS_RGB))
-		    reduce = 0;
-		else { /* we only reduce to RGB, GA or G */
-		    int out_spp = ((an & HAS_ALPHA) ? 1 : 0 ) + ((an & IS_RGB) ? 3 : 1);
-		    uint32_t i = 1, n = width * height;
-		    tdata_t buf;
-		    unsigned char *data8;
-		    const unsigned int *nd = (const unsigned int*) INTEGER(image);
-		    TIFFSetField(tiff, TIFFTAG_SAMPLESPERPIXEL, out_spp);
-		    TIFFSetField(tiff, TIFFTAG_ROWSPERSTRIP, height);
-		    TIFFSetField(tiff, TIFFTAG_COMPRESSION, compression);
-		    TIFFSetField(tiff, TIFFTAG_PHOTOMETRIC, (out_spp > 2) ? PHOTOMETRIC_RGB : PHOTOMETRIC_MINISBLACK);
-		    buf = _TIFFmalloc(width * height * out_spp);
-		    data8 = (unsigned char*) buf;
-		    if (out_spp == 1)
-			for (i = 0; i < n; i++) /* G */
-			    data8[i] = nd[i] & 255;
-		    else if (out_spp == 2) {
-			if (((const char*)&i)[0] == 1) /* little-endian */
-			    for (i = 0; i < n; i++) { /* GA */
-				*(data8++) = nd[i] & 255;
-				*(data8++) = (nd[i] >> 24) & 255;
-			    }
-			else /* big-endian */
-			    for (i = 0; i < n; i++) { /* GA */
-				*(data8++) = (nd[i] >> 24) & 255;
-				*(data8++) = nd[i] & 255;
-			    }
-		    } else if (out_spp == 3) {
-			if (((const char*)&i)[0] == 1) /* little-endian */
-			    for (i = 0; i < n; i++) { /* RGB */
-				*(data8++) = nd[i] & 255;
-				*(data8++) = (nd[i] >> 8) & 255;
-				*(data8++) = (nd[i] >> 16) & 255;
-			    }
-			else /* big-endian */
-			    for (i = 0; i < n; i++) { /* RGB */
-				*(data8++) = (nd[i] >> 16) & 255;
-				*(data8++) = (nd[i] >> 8) & 255;
-				*(data8++) = nd[i] & 255;
-			    }
-		    }
-		    TIFFWriteEncodedStrip(tiff, 0, buf, width * height * out_spp);
-		    _TIFFfree(buf);
-		}
-	    }
-	    if (!reduce) {
-		TIFFSetField(tiff, TIFFTAG_SAMPLESPERPIXEL, 4);
-		TIFFSetField(tiff, TIFFTAG_ROWSPERSTRIP, height);
-		TIFFSetField(tiff, TIFFTAG_COMPRESSION, compression);
-		TIFFSetField(tiff, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_RGB);
-		TIFFWriteEncodedStrip(tiff, 0, INTEGER(image), width * height * 4);
+		int an = analyze_native(nd, width * height);
+		if (an != (HAS_ALPHA | IS_RGB)) /* we only reduce to RGB, GA or G */
+		    im.spp = ((an & HAS_ALPHA) ? 1 : 0 ) + ((an & IS_RGB) ? 3 : 1);
+		if (write_timing)
+		    write_timing->convert += TIFF_Time() - t0; /* analyze_native() */
 	    }
+	    if (im.spp == 4) /* the chunks are encoded straight from the image */
+		im.rows = (const unsigned char*) nd;
+	    else
+		im.nd = nd;
 	} else {
-	    uint32_t x, y, pl;
-	    tdata_t buf;
-	    unsigned char *data8;
-	    unsigned short *data16;
-	    unsigned int *data32;
 	    double *ra = REAL(image);
 	    uint32_t i, N = LENGTH(image);
-	    for (i = 0; i < N; i++) /* do a pre-flight check */
-		if (ra[i] < 0.0 || ra[i] > 1.0) {
-		    Rf_warning("The input contains values outside the [0, 1] range - storage of such values is undefined");
-		    break;
-		}
-	    TIFFSetField(tiff, TIFFTAG_BITSPERSAMPLE, bps);
-	    TIFFSetField(tiff, TIFFTAG_SAMPLESPERPIXEL, planes);
-	    TIFFSetField(tiff, TIFFTAG_ROWSPERSTRIP, height);
-	    TIFFSetField(tiff, TIFFTAG_COMPRESSION, compression);
-	    TIFFSetField(tiff, TIFFTAG_PHOTOMETRIC, (planes > 2) ? PHOTOMETRIC_RGB : PHOTOMETRIC_MINISBLACK);
-	    buf = _TIFFmalloc(width * height * planes * (bps / 8));
-	    data8 = (unsigned char*) buf;
-	    data16 = (unsigned short*) buf;
-	    data32 = (unsigned int*) buf;
-	    if (!buf)
-		Rf_error("cannot allocate output image buffer");
-	    if (bps == 8)
-		for (y = 0; y < height; y++)
-		    for (x = 0; x < width; x++)
-			for (pl = 0; pl < planes; pl++)
-			    data8[(x + y * width) * planes + pl] = (unsigned char) (ra[y + x * height + pl * width * height] * 255.0);
-	    else if (bps == 16)
-		for (y = 0; y < height; y++)
-		    for (x = 0; x < width; x++)
-			for (pl = 0; pl < planes; pl++)
-			    data16[(x + y * width) * planes + pl] = (unsigned short) (ra[y + x * height + pl * width * height] * 65535.0);
-	    else if (bps == 32)
-		for (y = 0; y < height; y++)
-		    for (x = 0; x < width; x++)
-			for (pl = 0; pl < planes; pl++)
-			    data32[(x + y * width) * planes + pl] = (unsigned int) (ra[y + x * height + pl * width * height] * 4294967295.0);
-	    TIFFWriteEncodedStrip(tiff, 0, buf, width * height * planes * (bps / 8));
-	    _TIFFfree(buf);
-	}
-
-	if (img_list && img_index < n_img)
+	    for (i = 0; !out_of_range && i < N; i++) /* do a pre-flight check */
+		if (ra[i] < 0.0 || ra[i] > 1.0)
+		    out_of_range = 1;
+	    im.bps = bps;
+	    im.spp = planes;
+	    im.ra = ra;
+	}
+	/* a failure leaves the directory of a handle half-written, so the
+	   handle refuses further images until this one is complete (older
+	   libtiff raises errors right away) */
+	if (h)
+	    h->failed = 1;
+	if (!write_image(tiff, &im, &lay, pyramid, err, sizeof(err))) {
+	    if (!h)
+		TIFFClose(tiff);
+	    Rf_error("%s", err);
+	}
+
+	if (h) { /* images of a handle are completed and flushed right away */
 	    TIFFWriteDirectory(tiff);
-	else break;
+	    fflush(job->f);
+	    h->failed = (job->errors != 0);
+	    check_output(0, job);
+	    h->pages++;
+	} else
+	    check_output(tiff, &rj);
+	if (img_list && img_index < n_img) {
+	    if (!h)
+		TIFFWriteDirectory(tiff);
+	} else break;
     }
-    if (!rj.f) {
-	SEXP res;
+    if (h)
+	res = ScalarInteger(h->pages);
+    else if (!rj.f) {
+	double t0;
 	TIFFFlush(tiff);
+	check_output(tiff, &rj);
+	t0 = write_timing ? TIFF_Time() : 0;
 	res = allocVector(RAWSXP, rj.len);
 #if TIFF_DEBUG
 	Rprintf("convert to raw %d bytes (ptr=%d, alloc=%d)\n", rj.len, rj.ptr, rj.alloc);
 #endif
 	memcpy(RAW(res), rj.data, rj.len);
+	if (write_timing)
+	    write_timing->alloc += TIFF_Time() - t0;
+    } else
+	res = ScalarInteger(n_img);
+    /* warnings are raised once the file is complete and closed (the
+       TIFF of a handle is kept by R) */
+    if (!h) {
+	PROTECT(res);
 	TIFFClose(tiff);
-	return res;
+	check_output(0, &rj);
+	UNPROTECT(1);
+    } else
+	check_output(0, job);
+    if (out_of_range)
+	Rf_warning("The input contains values outside the [0, 1] range - storage of such values is undefined");
+    return res;
+}
+
+static SEXP write_body(void *data) {
+    SEXP *a = (SEXP*) data;
+    return write_images(a[0], a[1], a[2], a[3], a[4], a[5], a[6], a[7], a[8]);
+}
+
+SEXP write_tiff(SEXP image, SEXP where, SEXP sBPS, SEXP sCompr, SEXP sReduce, SEXP sRPS, SEXP sTile,
+		SEXP sPyramid, SEXP sThreads, SEXP sTiming) {
+    double t0 = TIFF_Time();
+    SEXP args[9] = { image, where, sBPS, sCompr, sReduce, sRPS, sTile, sPyramid, sThreads }, res;
+    write_timing = (asInteger(sTiming) == 1) ? &write_stats : 0;
+    res = TIFF_Timed(write_timing, write_body, args);
+    if (write_timing && res != R_NilValue) {
+	PROTECT(res);
+	setAttrib(res, install("timing"), TIFF_Timing_Info(write_timing, TIFF_Time() - t0));
+	UNPROTECT(1);
     }
-    TIFFClose(tiff);
-    return ScalarInteger(n_img);
+    write_timing = 0;
+    return res;
 }